@@ -0,0 +1,28 @@
+#pragma once
+// boost 1.74 awaitable.hpp uses std::exchange without including <utility>
+#include <utility>
+
+#include <boost/asio/associated_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <memory>
+
+// Adapt a callback based operation to an asio completion token, e.g.
+// boost::asio::use_awaitable. `start` is called with a copyable callback
+// taking the arguments of `Signature`. The completion is posted to the
+// executor of the handler rather than run from the callback, so a coroutine
+// never resumes in the middle of a D-Bus dispatch or MQTT packet handler.
+template <typename Signature, typename Token, typename Start>
+auto async_callback(Token &&token, Start start) {
+  return boost::asio::async_initiate<Token, Signature>(
+      [start](auto handler) mutable {
+        auto h = std::make_shared<decltype(handler)>(std::move(handler));
+        start([h](auto... args) {
+          auto ex = boost::asio::get_associated_executor(*h);
+          boost::asio::post(ex, [h, args...]() mutable { (*h)(args...); });
+        });
+      },
+      token);
+}
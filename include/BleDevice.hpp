@@ -1,31 +1,135 @@
 #pragma once
+#include <Awaitable.hpp>
 #include <BleManager.hpp>
 #include <cstdint>
 #include <dbus/dbus.h>
+#include <functional>
+#include <map>
 #include <string>
+#include <vector>
 
-// Generic BLE device class for use with Bluez DBus
+// Defined here rather than in BleManager.hpp, which includes this header
+// before its own declarations
+#define BLUEZ_DEFAULT_ADAPTER "/org/bluez/hci0"
+// Method call templates kept per device before they are all dropped
+#define GATT_TEMPLATES_MAX 512
+
+// Completion of a GATT write, err is 0 once bluez has the acknowledgement of
+// the device, GATT_WRITE_UNACKED when only handed to an AcquireWrite socket
+// and negative on failure
+#define GATT_WRITE_UNACKED 1
+typedef std::function<void(int err)> gatt_write_cb;
+// A single notification payload read from an AcquireNotify socket
+typedef std::function<void(const uint8_t *value, int len)> gatt_notify_cb;
+// Completion of an asynchronous operation, a value >= 0 or -1 on failure
+typedef std::function<void(int result)> ble_result_cb;
+// Completion of AcquireNotify, fd is 0 on failure
+typedef std::function<void(int fd, uint16_t mtu)> gatt_acquire_cb;
+// Reply of an asynchronous method call, nullptr on error or timeout
+typedef std::function<void(DBusMessage *reply)> dbus_reply_cb;
+
+// Generic BLE device class for use with Bluez DBus. Method calls keep their
+// scratch state on the stack, so a call may be made from a reply callback of
+// another one.
 class BleDevice {
-  DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
-  DBusMessageIter iter0, iter1, iter2;
-  DBusError dbus_error;
+  // AcquireWrite sockets by characteristic path, -1 when not supported
+  std::map<std::string, int> write_fds;
+  // Complete method calls by "<characteristic path>.<method>", WriteValue
+  // calls also by the value written
+  std::map<std::string, DBusMessage *> templates;
+
+  DBusMessage *gatt_template(const std::string &key,
+                             const std::function<DBusMessage *()> &build);
+  DBusMessage *gatt_message(const std::string &charPath, const char *member);
 
 protected:
+  int dbus_call(DBusMessage *msg, int timeout_ms, dbus_reply_cb done);
+  DBusMessage *dbus_call_block(DBusMessage *msg, int timeout_ms,
+                               DBusError *error);
+
 public:
+  std::string adapterPath;
   std::string devicePath;
   std::string mac;
+  // Higher priority devices are evicted last from the connection pool
+  int priority = 0;
+  // Write through AcquireWrite sockets when bluez offers them
+  bool gatt_write_fast = true;
 
-  BleDevice(std::string m);
+  BleDevice(std::string m, std::string adapter = BLUEZ_DEFAULT_ADAPTER);
+  virtual ~BleDevice();
 
   std::string &deviceMacReplace(std::string &mac);
   std::string dbusPathFromMac(std::string &mac);
+  void adapter_set(const std::string &adapter);
 
   int device_connected_get();
   int device_connected_set(uint8_t level);
   int device_connect_check();
+  void device_connect_async(ble_result_cb done, int timeout_ms = 20000);
+  void device_disconnect_async(ble_result_cb done);
+  void device_property_async(const char *name, ble_result_cb done);
+
+  std::string gatt_char_path(const std::string &uuid,
+                             const std::string &fallback);
+
+  int gatt_read_char_byte(const std::string &charPath);
+  int gatt_write_char_byte(const std::string &charPath, uint8_t byte,
+                           gatt_write_cb done = nullptr,
+                           int timeout_ms = 2000);
+  int gatt_write_char(const std::string &charPath, const uint8_t *value,
+                      int len, gatt_write_cb done = nullptr,
+                      int timeout_ms = 2000);
+  void gatt_read_char_async(const std::string &charPath, ble_result_cb done);
+  int gatt_notify_char(const std::string &charPath, uint16_t *mtu);
+  void gatt_notify_char_async(const std::string &charPath,
+                              gatt_acquire_cb done);
+  int gatt_notify_drain(int fd, std::vector<uint8_t> &buf,
+                        const gatt_notify_cb &cb);
+  int gatt_acquire_write(const std::string &charPath, uint16_t *mtu);
+  DBusMessage *gatt_write_message(const std::string &charPath,
+                                  const uint8_t *value, int len);
+  void gatt_release_fds();
+  void gatt_release_templates();
+  // Called when the link is dropped, releases everything tied to it
+  virtual void link_lost();
 
-  int gatt_read_char_byte(std::string service, std::string characteristic);
-  int gatt_write_char_byte(std::string service, std::string characteristic,
-                           uint8_t byte);
-  int gatt_notify_char(std::string service, std::string characteristic);
+  // Awaitable versions of the asynchronous operations, e.g.
+  //   int value = co_await device.async_read(path, boost::asio::use_awaitable);
+  // Replies are only seen when the thread owning the D-Bus connection calls
+  // bleManager.process(), so the awaiting coroutine must run on an
+  // io_context polled by that same thread.
+  template <typename Token> auto async_connect(Token &&token) {
+    return async_callback<void(int)>(
+        std::forward<Token>(token),
+        [this](auto done) { this->device_connect_async(done); });
+  }
+  template <typename Token>
+  auto async_property(const char *name, Token &&token) {
+    return async_callback<void(int)>(
+        std::forward<Token>(token),
+        [this, name](auto done) { this->device_property_async(name, done); });
+  }
+  template <typename Token>
+  auto async_read(const std::string &charPath, Token &&token) {
+    return async_callback<void(int)>(
+        std::forward<Token>(token), [this, charPath](auto done) {
+          this->gatt_read_char_async(charPath, done);
+        });
+  }
+  template <typename Token>
+  auto async_write(const std::string &charPath, const uint8_t *value, int len,
+                   Token &&token) {
+    return async_callback<void(int)>(
+        std::forward<Token>(token), [this, charPath, value, len](auto done) {
+          this->gatt_write_char(charPath, value, len, done);
+        });
+  }
+  template <typename Token>
+  auto async_acquire_notify(const std::string &charPath, Token &&token) {
+    return async_callback<void(int, uint16_t)>(
+        std::forward<Token>(token), [this, charPath](auto done) {
+          this->gatt_notify_char_async(charPath, done);
+        });
+  }
 };
@@ -1,20 +1,136 @@
 #pragma once
 #include "BleDevice.hpp"
+#include <atomic>
+#include <chrono>
 #include <dbus/dbus.h>
+#include <functional>
+#include <list>
 #include <map>
+#include <mutex>
 #include <string>
+#include <vector>
 
+class BleDevice;
+
+// Handler of a signal about one object path
+typedef std::function<void(DBusMessage *msg)> signal_cb;
+
+// Shared by every BLE worker thread. Each thread talks to bluez over its own
+// private connection, the state below is guarded by `lock`.
 class BleManager {
-  DBusConnection *conn = nullptr;
+public:
+  struct pool_stats {
+    unsigned int hits = 0;
+    unsigned int misses = 0;
+    unsigned int evictions = 0;
+    double connect_ms_total = 0;
+    double connect_ms_max = 0;
+    unsigned int links = 0;
+  };
+  // D-Bus calls made for one adapter and its devices
+  struct adapter_stats {
+    unsigned long calls = 0;
+    unsigned long errors = 0;
+    // Calls bluez did not answer in time, a subset of errors
+    unsigned long timeouts = 0;
+    double latency_ms_total = 0;
+    double latency_ms_max = 0;
+    // Power cycles, and how the last one went
+    unsigned int recoveries = 0;
+    double recovery_ms_last = 0;
+    unsigned int links_lost_last = 0;
+    unsigned int links_restored_last = 0;
+  };
+
+private:
+  static thread_local DBusConnection *conn;
+  // object path -> PropertiesChanged handler, for the connection of this thread
+  static thread_local std::map<std::string, signal_cb> handlers;
+  std::recursive_mutex lock;
+  // device path -> (characteristic UUID -> characteristic object path)
+  std::map<std::string, std::map<std::string, std::string>> characteristics;
+  // device path -> last RSSI reported by the adapter owning that path
+  std::map<std::string, int> rssi;
+  // adapter path -> result of the last ble_power_check()
+  std::map<std::string, bool> adapter_healthy;
+  // device MAC -> adapter path the device is served from
+  std::map<std::string, std::string> assignments;
+  // Connected devices, most recently used first
+  std::list<BleDevice *> links;
+  pool_stats pool;
+  // adapter path -> call statistics
+  std::map<std::string, adapter_stats> health;
+  // adapter path -> calls and timeouts in the current and the previous
+  // health window, and when the adapter last recovered
+  struct health_window {
+    std::chrono::steady_clock::time_point start;
+    unsigned int calls = 0;
+    unsigned int timeouts = 0;
+    unsigned int previous_calls = 0;
+    unsigned int previous_timeouts = 0;
+    std::chrono::steady_clock::time_point recovered;
+  };
+  std::map<std::string, health_window> windows;
+
+  static DBusHandlerResult signal_filter(DBusConnection *connection, DBusMessage *msg, void *data);
+  void object_added(const char *path, DBusMessageIter *interfaces);
+  void object_removed(const char *path);
+  void match(const std::string &rule, bool add);
+  bool link_reserve(BleDevice *device, BleDevice *&victim);
+  void link_add(BleDevice *device, double ms);
 
 public:
+  // Paths of every org.bluez.Adapter1 object, e.g. "/org/bluez/hci0". Use
+  // adapter_list() once worker threads are running.
+  std::vector<std::string> adapters;
+  // Maximum connected devices per adapter, 0 for no limit
+  int max_links = 0;
+  // Signals delivered by the bus to any thread, and those that reached a
+  // handler. A gap means the match rules are wider than needed.
+  std::atomic<unsigned long> signals_received{0};
+  std::atomic<unsigned long> signals_handled{0};
+
   BleManager();
 
   DBusConnection *getConn();
+  void closeConn();
 
-  int ble_power_get();
-  int ble_power_set(int state);
+  int ble_power_get(const std::string &adapter);
+  int ble_power_set(const std::string &adapter, int state);
   int ble_power_check();
+  bool ble_power_check(const std::string &adapter);
+
+  std::vector<std::string> adapter_list();
+  bool adapter_ok(const std::string &adapter);
+  bool adapter_reaches(const std::string &adapter, const std::string &mac);
+  int adapter_load(const std::string &adapter);
+  std::string adapter_assign(const std::string &mac, const std::string &policy,
+                             const std::string &preferred,
+                             const std::string &exclude = "");
+
+  bool link_held(BleDevice *device);
+  int link_acquire(BleDevice *device);
+  void link_acquire_async(BleDevice *device, std::function<void(int err)> done);
+  void link_release(BleDevice *device);
+  pool_stats pool_get();
+
+  void adapter_call(const std::string &adapter, double ms, const char *error);
+  bool adapter_failing(const std::string &adapter);
+  void adapter_recovered(const std::string &adapter, double ms,
+                         unsigned int lost, unsigned int restored);
+  std::map<std::string, adapter_stats> adapter_stats_get();
+
+  void objects_watch(const std::string &path, bool subtree, bool add = true);
+  void signal_watch(const std::string &path, const std::string &iface,
+                    signal_cb handler);
+  void signal_unwatch(const std::string &path, const std::string &iface);
+  static int property_bool(DBusMessage *msg, const char *name);
+
+  int gatt_discover();
+  void process();
+  std::string gatt_char_path(const std::string &devicePath, const std::string &uuid);
+  void gatt_char_seed(const std::string &devicePath, const std::string &uuid,
+                      const std::string &charPath);
 };
 
 extern BleManager bleManager;
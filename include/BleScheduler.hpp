@@ -0,0 +1,62 @@
+#pragma once
+#include "BleDevice.hpp"
+#include <array>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+
+// Operation classes in dispatch priority order
+enum BleOpClass {
+  BLE_OP_COMMAND = 0,
+  BLE_OP_READ = 1,
+  BLE_OP_CONNECT = 2,
+  BLE_OP_CLASSES = 3,
+};
+
+// An operation must call `done` once it no longer occupies the adapter,
+// either before returning (blocking calls) or from its reply callback
+typedef std::function<void()> ble_op_done;
+typedef std::function<void(ble_op_done done)> ble_op_run;
+
+// Queues BLE operations per bulb and hands them to each adapter with deficit
+// round robin, so one busy bulb cannot starve the others. Commands always go
+// before reads, and reads before connection attempts. Not thread safe, every
+// BLE worker thread owns one.
+class BleScheduler {
+  struct op_s {
+    ble_op_run run;
+    int cost;
+    std::chrono::steady_clock::time_point queued;
+  };
+  struct device_queue {
+    std::deque<op_s> ops;
+    int deficit = 0;
+  };
+  struct adapter_queue {
+    // Devices with queued operations, in round robin order
+    std::array<std::deque<BleDevice *>, BLE_OP_CLASSES> ring;
+    std::array<std::map<BleDevice *, device_queue>, BLE_OP_CLASSES> queues;
+    int inFlight = 0;
+  };
+  std::map<std::string, adapter_queue> adapters;
+
+  bool next(adapter_queue &adapter, op_s &op, int &cls);
+
+public:
+  // Operations running at once on one adapter
+  int max_in_flight = 2;
+  // Airtime credited to a bulb per round, commands and reads cost 1
+  int quantum = 1;
+
+  struct class_stats {
+    unsigned long dispatched = 0;
+    double wait_ms_total = 0;
+    double wait_ms_max = 0;
+  } stats[BLE_OP_CLASSES];
+
+  void submit(BleDevice *device, BleOpClass cls, ble_op_run run);
+  int dispatch();
+  size_t queued();
+};
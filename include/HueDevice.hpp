@@ -2,13 +2,35 @@
 
 #include "BleDevice.hpp"
 #include <cstdint>
+#include <optional>
+#include <vector>
 
 // To reset bulb turn on for 8 seconds, off for 2. Repeat until bulbs rapidly
 // flash.
 
+#define PHILIPS_POWER_UUID "932c32bd-0002-47a2-835a-a8d455b859dd"
+#define PHILIPS_LEVEL_UUID "932c32bd-0003-47a2-835a-a8d455b859dd"
+#define PHILIPS_CONTROL_UUID "932c32bd-0007-47a2-835a-a8d455b859dd"
+
+// Record types of the combined light control characteristic, each written as
+// type, length, little endian value
+#define PHILIPS_CONTROL_POWER 0x01
+#define PHILIPS_CONTROL_BRIGHTNESS 0x02
+#define PHILIPS_CONTROL_MIREDS 0x03
+#define PHILIPS_CONTROL_TRANSITION 0x05
+
+// Attributes to change in a single apply(), unset fields are left alone
+struct LightState {
+  std::optional<uint8_t> power{};
+  std::optional<uint8_t> brightness{};
+  std::optional<uint16_t> mireds{};
+  // Transition time in 100 ms steps
+  std::optional<uint16_t> transition{};
+};
+
 class HueDevice : public BleDevice {
 public:
-  HueDevice(std::string mac);
+  HueDevice(std::string mac, std::string adapter = BLUEZ_DEFAULT_ADAPTER);
   class Power {
     HueDevice *parent;
 
@@ -28,12 +50,24 @@ public:
 
   int light_power_fd = 0;
   int light_brightness_fd = 0;
+  // Notification buffers, sized to the MTU returned by AcquireNotify
+  std::vector<uint8_t> light_power_buf;
+  std::vector<uint8_t> light_brightness_buf;
+
+  std::string light_power_path();
+  std::string light_brightness_path();
+  std::string light_control_path();
+
+  static std::vector<uint8_t> light_control_encode(const LightState &state);
+  int apply(const LightState &state, gatt_write_cb done = nullptr);
 
   int light_power_get();
-  int light_power_set(uint8_t level);
+  int light_power_set(uint8_t level, gatt_write_cb done = nullptr);
   int light_power_notify_get();
 
   int light_brightness_get();
-  int light_brightness_set(uint8_t level);
+  int light_brightness_set(uint8_t level, gatt_write_cb done = nullptr);
   int light_brightness_notify_get();
+  void light_notify_release();
+  void link_lost() override;
 };
@@ -0,0 +1,50 @@
+#pragma once
+#include "HueDevice.hpp"
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+
+#define LIGHT_CACHE_HOURS (7 * 24)
+
+// What was learned about each bulb in earlier runs, so a restart can
+// announce the lights and their last state before bluez has answered
+// anything, and links can be warmed up before the bulbs are usually used.
+// Stored as a small binary file that is replaced atomically. Not thread
+// safe, only the MQTT thread uses it.
+class LightCache {
+public:
+  struct entry {
+    // Adapter the bulb was served from, e.g. "/org/bluez/hci0"
+    std::string adapter;
+    // Characteristic UUID -> object path
+    std::map<std::string, std::string> paths;
+    // ATT MTU of the link, 0 when unknown
+    uint16_t mtu = 0;
+    // Last state reported by the bulb and when it was reported
+    LightState state;
+    time_t time = 0;
+    // Hours the bulb was commanded in, by hour of the week from Sunday
+    // midnight local time. Halved when one reaches 255.
+    std::array<uint8_t, LIGHT_CACHE_HOURS> usage{};
+  };
+
+private:
+  // Device MAC -> entry
+  std::map<std::string, entry> entries;
+  bool dirty = false;
+
+public:
+  int load(const std::string &file);
+  int save(const std::string &file);
+  bool changed() { return dirty; }
+
+  const entry *find(const std::string &mac);
+  void adapter_set(const std::string &mac, const std::string &adapter);
+  void path_set(const std::string &mac, const std::string &uuid,
+                const std::string &path);
+  void mtu_set(const std::string &mac, uint16_t mtu);
+  void state_set(const std::string &mac, const LightState &state);
+  void usage_add(const std::string &mac, int hour);
+};
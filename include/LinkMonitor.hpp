@@ -0,0 +1,31 @@
+#pragma once
+#include <chrono>
+#include <deque>
+
+// How long the links of one bulb last, so they can be kept up ahead of the
+// bulb dropping them. Times are passed in, the bookkeeping needs no bulb.
+// Not thread safe, only the worker of the bulb uses it.
+class LinkMonitor {
+public:
+  typedef std::chrono::steady_clock::time_point time_point;
+
+  time_point linkUp;
+  time_point lastTraffic;
+  // Seconds the bulb was idle before dropping its link, and link ages at
+  // drops that happened despite recent traffic. Newest last.
+  std::deque<double> dropIdle;
+  std::deque<double> dropAge;
+  unsigned long drops = 0;
+
+  void up(time_point now);
+  void traffic(time_point now);
+  void cycle(time_point now);
+  bool cycling(time_point now) const;
+  bool dropped(time_point now, bool held, int keepalive_ms);
+
+private:
+  // The link is being dropped on purpose, until bluez reports it down or
+  // the deadline passes
+  bool cycle_pending = false;
+  time_point cycle_deadline;
+};
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <queue>
 #include <stdio.h>
 #include <vector>
@@ -14,6 +16,8 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
 
+#include "Awaitable.hpp"
+
 using namespace std;
 
 namespace Mqtt {
@@ -92,6 +96,17 @@ const uint8_t SUBSCRIPTION_IDENTIFIER_AVAILABLE = 0x29;
 const uint8_t SHARED_SUBSCRIPTION_AVAILABLE = 0x2A;
 } // namespace ConnackProperties
 
+namespace PublishProperties {
+const uint8_t PAYLOAD_FORMAT_INDICATOR = 0x01;
+const uint8_t MESSAGE_EXPIRY_INTERVAL = 0x02;
+const uint8_t CONTENT_TYPE = 0x03;
+const uint8_t RESPONSE_TOPIC = 0x08;
+const uint8_t CORRELATION_DATA = 0x09;
+const uint8_t SUBSCRIPTION_IDENTIFIER = 0x0B;
+const uint8_t TOPIC_ALIAS = 0x23;
+const uint8_t USER_PROPERTY = 0x26;
+} // namespace PublishProperties
+
 namespace SubackProperties {
 const uint8_t REASON_STRING = 0x1F;
 const uint8_t USER_PROPERTY = 0x26;
@@ -103,6 +118,9 @@ struct Publish {
   uint16_t packet_identifier;
   string topic;
   string message;
+  // Message Expiry Interval in seconds, 0 when the sender did not set one
+  uint32_t message_expiry = 0;
+  chrono::steady_clock::time_point arrival = chrono::steady_clock::now();
 };
 
 struct ConnAck {
@@ -140,20 +158,92 @@ class Session {
   bool pingSent = false;
   bool pingReceived = false;
 
+  struct Retained {
+    string message;
+    uint8_t qos;
+    chrono::steady_clock::time_point sent;
+  };
+  // Last retained payload published per topic
+  map<string, Retained> retained;
+  // Minimum time between publishes per rate limited topic, the newest
+  // payload published in between is held and sent when the interval ends
+  map<string, chrono::milliseconds> rate_limits;
+  map<string, chrono::steady_clock::time_point> last_sent;
+  map<string, Publish> held;
+
+  // Callbacks waiting for a PUBACK, SUBACK or UNSUBACK by packet identifier.
+  // They get the reason code (the granted QoS for SUBACK, >= 0x80 on
+  // failure), or -1 when the connection is lost first.
+  map<uint16_t, function<void(int)>> acks;
+  // Callbacks waiting for CONNACK, they get its reason code
+  vector<function<void(int)>> connacks;
+  uint16_t last_packet_identifier = 1;
+
+  void send(const Publish &pub);
+  void flush();
+  uint16_t packet_identifier_next();
+  void ack(uint16_t packet_identifier, int reason);
+
 public:
   boost::asio::io_context io_context;
   boost::asio::ip::tcp::socket socket;
   queue<Publish> pub_incoming_queue;
   queue<Publish> pub_outgoing_queue;
   vector<Subscribe> subscriptions;
+  // Seconds after which an unchanged retained payload is published again,
+  // 0 never republishes
+  int heartbeat = 0;
+  // Retained publishes skipped because the payload had not changed
+  unsigned long suppressed = 0;
 
   Session() : socket(io_context) {}
   void init(string addr, int port, string client_id, string username,
             string password);
+  void init(string addr, int port, string client_id, string username,
+            string password, function<void(int)> connected);
   void process();
   void handleSocket();
   void connect();
   void publish(string topic, string message, uint8_t qos, bool retain);
+  void republish();
+  void rate_limit(string topic, int interval_ms);
   void subscribe(string topic, uint8_t qos, uint16_t packet_identifier);
+  void publish(string topic, string message, bool retain,
+               function<void(int)> acked);
+  void subscribe(string topic, uint8_t qos, function<void(int)> acked);
+  void unsubscribe(string topic, function<void(int)> acked);
+
+  // Awaitable versions completing on CONNACK, PUBACK (QoS 1), SUBACK and
+  // UNSUBACK with the reason code, e.g.
+  //   co_await session.async_publish(t, m, true, boost::asio::use_awaitable);
+  // The awaiting coroutine must run on io_context, polled by the thread
+  // calling process().
+  template <typename Token>
+  auto async_connect(string addr, int port, string client_id, string username,
+                     string password, Token &&token) {
+    return async_callback<void(int)>(std::forward<Token>(token),
+                                     [=, this](auto done) {
+                                       init(addr, port, client_id, username,
+                                            password, done);
+                                     });
+  }
+  template <typename Token>
+  auto async_publish(string topic, string message, bool retain,
+                     Token &&token) {
+    return async_callback<void(int)>(
+        std::forward<Token>(token),
+        [=, this](auto done) { publish(topic, message, retain, done); });
+  }
+  template <typename Token>
+  auto async_subscribe(string topic, uint8_t qos, Token &&token) {
+    return async_callback<void(int)>(
+        std::forward<Token>(token),
+        [=, this](auto done) { subscribe(topic, qos, done); });
+  }
+  template <typename Token> auto async_unsubscribe(string topic, Token &&token) {
+    return async_callback<void(int)>(
+        std::forward<Token>(token),
+        [=, this](auto done) { unsubscribe(topic, done); });
+  }
 };
 } // namespace Mqtt
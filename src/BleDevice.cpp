@@ -1,12 +1,24 @@
 #include "BleDevice.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
+#include <sys/socket.h>
 #include <syslog.h>
+#include <unistd.h>
 
-BleDevice::BleDevice(std::string m) : mac(m)
+BleDevice::BleDevice(std::string m, std::string adapter) : adapterPath(adapter), mac(m)
 {
 	this->devicePath = dbusPathFromMac(m);
 }
 
+BleDevice::~BleDevice()
+{
+	this->gatt_release_fds();
+	this->gatt_release_templates();
+}
+
 std::string &BleDevice::deviceMacReplace(std::string &mac)
 {
 	for (auto &e : mac) {
@@ -18,27 +30,120 @@ std::string &BleDevice::deviceMacReplace(std::string &mac)
 
 std::string BleDevice::dbusPathFromMac(std::string &mac)
 {
-	return std::string("/org/bluez/hci0/dev_") + deviceMacReplace(mac);
+	return this->adapterPath + "/dev_" + deviceMacReplace(mac);
+}
+
+// Move the device to another adapter. Sockets acquired through the old
+// adapter are no longer valid.
+void BleDevice::adapter_set(const std::string &adapter)
+{
+	std::string m = this->mac;
+
+	this->gatt_release_fds();
+	this->gatt_release_templates();
+	this->adapterPath = adapter;
+	this->devicePath = dbusPathFromMac(m);
+}
+
+// Resolve a characteristic by UUID, falling back to a known handle layout
+// (e.g. "/service002c/char002f") when it has not been discovered yet
+std::string BleDevice::gatt_char_path(const std::string &uuid, const std::string &fallback)
+{
+	std::string path = bleManager.gatt_char_path(this->devicePath, uuid);
+
+	if (path.empty())
+		return this->devicePath + fallback;
+	return path;
+}
+
+// Copy of the complete method call stored under `key`, built by `build` the
+// first time. Appending arguments costs far more than copying a finished
+// message, so whole calls are kept rather than just their headers.
+DBusMessage *BleDevice::gatt_template(const std::string &key, const std::function<DBusMessage *()> &build)
+{
+	auto search = this->templates.find(key);
+
+	if (search == this->templates.end()) {
+		DBusMessage *msg;
+
+		// Values written by a device are few, but keep a bound on them
+		if (this->templates.size() >= GATT_TEMPLATES_MAX)
+			this->gatt_release_templates();
+		msg = build();
+		if (msg == nullptr)
+			return nullptr;
+		search = this->templates.emplace(key, msg).first;
+	}
+	return dbus_message_copy(search->second);
+}
+
+// A method call on a characteristic taking only an empty options dict
+DBusMessage *BleDevice::gatt_message(const std::string &charPath, const char *member)
+{
+	return this->gatt_template(charPath + "." + member, [&charPath, member]() {
+		DBusMessageIter iter0, iter1;
+		DBusMessage *msg =
+			dbus_message_new_method_call("org.bluez", charPath.c_str(), "org.bluez.GattCharacteristic1", member);
+
+		if (msg != nullptr) {
+			dbus_message_iter_init_append(msg, &iter0);
+			dbus_message_iter_open_container(&iter0, DBUS_TYPE_ARRAY, "{sv}", &iter1);
+			dbus_message_iter_close_container(&iter0, &iter1);
+		}
+		return msg;
+	});
+}
+
+// A WriteValue call carrying `value`, ready to send. Kept per value, a bulb
+// is mostly sent the same few power, brightness and scene values.
+DBusMessage *BleDevice::gatt_write_message(const std::string &charPath, const uint8_t *value, int len)
+{
+	auto key = charPath + ".WriteValue." + std::string((const char *)value, len);
+
+	return this->gatt_template(key, [&charPath, value, len]() {
+		DBusMessageIter iter0, iter1;
+		DBusMessage *msg = dbus_message_new_method_call("org.bluez", charPath.c_str(),
+								"org.bluez.GattCharacteristic1", "WriteValue");
+
+		if (msg != nullptr) {
+			dbus_message_iter_init_append(msg, &iter0);
+			dbus_message_iter_open_container(&iter0, DBUS_TYPE_ARRAY, "y", &iter1); // bytes
+			dbus_message_iter_append_fixed_array(&iter1, DBUS_TYPE_BYTE, &value, len);
+			dbus_message_iter_close_container(&iter0, &iter1);
+			dbus_message_iter_open_container(&iter0, DBUS_TYPE_ARRAY, "{sv}", &iter1); // flags (empty)
+			dbus_message_iter_close_container(&iter0, &iter1);
+		}
+		return msg;
+	});
+}
+
+void BleDevice::gatt_release_templates()
+{
+	for (auto &[key, msg] : this->templates)
+		dbus_message_unref(msg);
+	this->templates.clear();
 }
 
-int BleDevice::gatt_read_char_byte(std::string service, std::string characteristic)
+// Returns the first byte of the characteristic, or -1 on failure
+int BleDevice::gatt_read_char_byte(const std::string &charPath)
 {
+	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
+	DBusMessageIter iter0, iter1;
+	DBusError dbus_error;
 	uint8_t byte = 0;
+	int result = -1;
 
 	::dbus_error_init(&dbus_error);
-	dbus_msg = dbus_message_new_method_call("org.bluez",
-						(this->devicePath + "/service" + service + "/char" + characteristic).c_str(),
-						"org.bluez.GattCharacteristic1", "ReadValue");
+	dbus_msg = this->gatt_message(charPath, "ReadValue");
 	if (dbus_msg != nullptr) {
-		dbus_message_iter_init_append(dbus_msg, &this->iter0);
-		dbus_message_iter_open_container(&this->iter0, DBUS_TYPE_ARRAY, "{sv}", &this->iter1);
-		dbus_message_iter_close_container(&this->iter0, &this->iter1);
-		dbus_reply = ::dbus_connection_send_with_reply_and_block(bleManager.getConn(), this->dbus_msg,
-									 DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
+		dbus_reply = this->dbus_call_block(dbus_msg, DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
 		if (dbus_reply != nullptr) {
-			dbus_message_iter_init(dbus_reply, &this->iter0);
-			dbus_message_iter_recurse(&this->iter0, &this->iter1);
-			dbus_message_iter_get_basic(&this->iter1, &byte);
+			dbus_message_iter_init(dbus_reply, &iter0);
+			dbus_message_iter_recurse(&iter0, &iter1);
+			if (dbus_message_iter_get_arg_type(&iter1) == DBUS_TYPE_BYTE) {
+				dbus_message_iter_get_basic(&iter1, &byte);
+				result = byte;
+			}
 			dbus_message_unref(dbus_reply);
 		} else {
 			::perror(dbus_error.name);
@@ -49,48 +154,166 @@ int BleDevice::gatt_read_char_byte(std::string service, std::string characterist
 		}
 		dbus_message_unref(dbus_msg);
 	}
-	return byte;
+	return result;
 }
 
-int BleDevice::gatt_write_char_byte(std::string service, std::string characteristic, uint8_t byte)
+// A method call in flight, timed for the health of its adapter
+struct dbus_call_s {
+	dbus_reply_cb done;
+	std::string adapter;
+	std::chrono::steady_clock::time_point start;
+};
+
+static double dbus_call_ms(std::chrono::steady_clock::time_point start)
 {
-	dbus_msg = ::dbus_message_new_method_call("org.bluez",
-						  (this->devicePath + "/service" + service + "/char" + characteristic).c_str(),
-						  "org.bluez.GattCharacteristic1", "WriteValue");
-	if (dbus_msg != nullptr) {
-		dbus_message_iter_init_append(dbus_msg, &this->iter0);
-		dbus_message_iter_open_container(&this->iter0, DBUS_TYPE_ARRAY, "y",
-						 &this->iter1); // bytes
-		dbus_message_iter_append_basic(&this->iter1, DBUS_TYPE_BYTE, &byte);
-		dbus_message_iter_close_container(&this->iter0, &this->iter1);
-		dbus_message_iter_open_container(&this->iter0, DBUS_TYPE_ARRAY, "{sv}",
-						 &this->iter1); // flags (empty)
-		dbus_message_iter_close_container(&this->iter0, &this->iter1);
-		dbus_connection_send(bleManager.getConn(), this->dbus_msg, NULL);
-		dbus_message_unref(this->dbus_msg);
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void dbus_call_reply(DBusPendingCall *pending, void *data)
+{
+	auto call = static_cast<dbus_call_s *>(data);
+	DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+	const char *error = nullptr;
+
+	if (reply == nullptr || dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR) {
+		error = reply != nullptr ? dbus_message_get_error_name(reply) : DBUS_ERROR_NO_REPLY;
+		syslog(LOG_DEBUG, "DBUS call failed: %s", error);
 	}
+	bleManager.adapter_call(call->adapter, dbus_call_ms(call->start), error);
+	if (error != nullptr && reply != nullptr) {
+		dbus_message_unref(reply);
+		reply = nullptr;
+	}
+	call->done(reply);
+	if (reply != nullptr)
+		dbus_message_unref(reply);
+	dbus_pending_call_unref(pending);
+}
+
+static void dbus_call_free(void *data)
+{
+	delete static_cast<dbus_call_s *>(data);
+}
+
+// Blocking method call on the connection of this thread, timed for the
+// health of the adapter
+DBusMessage *BleDevice::dbus_call_block(DBusMessage *msg, int timeout_ms, DBusError *error)
+{
+	auto start = std::chrono::steady_clock::now();
+	DBusMessage *reply = ::dbus_connection_send_with_reply_and_block(bleManager.getConn(), msg, timeout_ms, error);
 
+	bleManager.adapter_call(this->adapterPath, dbus_call_ms(start), dbus_error_is_set(error) ? error->name : nullptr);
+	return reply;
+}
+
+// Send a method call without waiting for the reply and release `msg`. The
+// reply is handed to `done` from bleManager.process() on this thread, or
+// nullptr if the call failed or timed out.
+int BleDevice::dbus_call(DBusMessage *msg, int timeout_ms, dbus_reply_cb done)
+{
+	DBusPendingCall *pending = nullptr;
+
+	if (msg != nullptr) {
+		if (!dbus_connection_send_with_reply(bleManager.getConn(), msg, &pending, timeout_ms))
+			pending = nullptr;
+		dbus_message_unref(msg);
+	}
+	if (pending == nullptr) {
+		syslog(LOG_DEBUG, "DBUS error at %d ", __LINE__);
+		done(nullptr);
+		return -1;
+	}
+	dbus_pending_call_set_notify(pending, dbus_call_reply,
+				     new dbus_call_s{done, this->adapterPath, std::chrono::steady_clock::now()},
+				     dbus_call_free);
 	return 0;
 }
 
-int BleDevice::gatt_notify_char(std::string service, std::string characteristic)
+// Read the first byte of a characteristic without blocking
+void BleDevice::gatt_read_char_async(const std::string &charPath, ble_result_cb done)
+{
+	this->dbus_call(this->gatt_message(charPath, "ReadValue"), DBUS_TIMEOUT_USE_DEFAULT, [done](DBusMessage *reply) {
+		DBusMessageIter iter0, iter1;
+		uint8_t byte = 0;
+
+		if (reply == nullptr) {
+			done(-1);
+			return;
+		}
+		dbus_message_iter_init(reply, &iter0);
+		dbus_message_iter_recurse(&iter0, &iter1);
+		if (dbus_message_iter_get_arg_type(&iter1) != DBUS_TYPE_BYTE) {
+			done(-1);
+			return;
+		}
+		dbus_message_iter_get_basic(&iter1, &byte);
+		done(byte);
+	});
+}
+
+int BleDevice::gatt_write_char_byte(const std::string &charPath, uint8_t byte, gatt_write_cb done, int timeout_ms)
+{
+	return this->gatt_write_char(charPath, &byte, 1, done, timeout_ms);
+}
+
+// Submits the write and returns immediately. The result is reported through
+// `done` once bluez replies, or with an error after `timeout_ms`. Writes
+// through an AcquireWrite socket go out without response, so nothing
+// acknowledges them and `done` gets GATT_WRITE_UNACKED right away.
+int BleDevice::gatt_write_char(const std::string &charPath, const uint8_t *value, int len, gatt_write_cb done,
+			       int timeout_ms)
 {
-	uint16_t byte = 0;
+	if (this->gatt_write_fast) {
+		auto search = this->write_fds.find(charPath);
+		int fd = 0;
+
+		if (search == this->write_fds.end()) {
+			uint16_t mtu = 0;
+			fd = this->gatt_acquire_write(charPath, &mtu);
+			this->write_fds[charPath] = fd;
+		} else {
+			fd = search->second;
+		}
+		if (fd >= 0) {
+			// bluetoothd closes the socket when the link drops, which must
+			// not raise SIGPIPE
+			if (::send(fd, value, len, MSG_NOSIGNAL) == len) {
+				if (done)
+					done(GATT_WRITE_UNACKED);
+				return 0;
+			}
+			// The link went away, every socket of the device is dead. New
+			// ones are acquired on the next write.
+			syslog(LOG_DEBUG, "AcquireWrite socket for %s failed (%d), using WriteValue", charPath.c_str(),
+			       errno);
+			this->gatt_release_fds();
+		}
+	}
+
+	return this->dbus_call(this->gatt_write_message(charPath, value, len), timeout_ms, [done](DBusMessage *reply) {
+		if (done)
+			done(reply != nullptr ? 0 : -1);
+	});
+}
+
+// Returns a non-blocking notification socket for the characteristic, or 0 on
+// failure. `mtu` receives the largest notification the socket can deliver.
+int BleDevice::gatt_notify_char(const std::string &charPath, uint16_t *mtu)
+{
+	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
+	DBusError dbus_error;
+	int fd = 0;
 
 	::dbus_error_init(&dbus_error);
-	dbus_msg = dbus_message_new_method_call("org.bluez",
-						(this->devicePath + "/service" + service + "/char" + characteristic).c_str(),
-						"org.bluez.GattCharacteristic1", "AcquireNotify");
+	dbus_msg = this->gatt_message(charPath, "AcquireNotify");
 	if (dbus_msg != nullptr) {
-		dbus_message_iter_init_append(dbus_msg, &this->iter0);
-		dbus_message_iter_open_container(&this->iter0, DBUS_TYPE_ARRAY, "{sv}", &this->iter1);
-		dbus_message_iter_close_container(&this->iter0, &this->iter1);
-		dbus_reply = ::dbus_connection_send_with_reply_and_block(bleManager.getConn(), this->dbus_msg,
-									 DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
+		dbus_reply = this->dbus_call_block(dbus_msg, DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
 
 		if (dbus_reply != nullptr) {
-			dbus_message_iter_init(dbus_reply, &this->iter0);
-			dbus_message_iter_get_basic(&this->iter0, &byte);
+			if (!dbus_message_get_args(dbus_reply, &dbus_error, DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_UINT16, mtu,
+						   DBUS_TYPE_INVALID)) {
+				fd = 0;
+			}
 			dbus_message_unref(dbus_reply);
 		} else {
 			::perror(dbus_error.name);
@@ -101,7 +324,92 @@ int BleDevice::gatt_notify_char(std::string service, std::string characteristic)
 		}
 		dbus_message_unref(dbus_msg);
 	}
-	return byte;
+	if (fd > 0)
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+// AcquireNotify without blocking, `done` gets a non-blocking socket and its
+// MTU, or fd 0 on failure
+void BleDevice::gatt_notify_char_async(const std::string &charPath, gatt_acquire_cb done)
+{
+	this->dbus_call(this->gatt_message(charPath, "AcquireNotify"), DBUS_TIMEOUT_USE_DEFAULT, [done](DBusMessage *reply) {
+		int fd = 0;
+		uint16_t mtu = 0;
+
+		if (reply == nullptr ||
+		    !dbus_message_get_args(reply, nullptr, DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_UINT16, &mtu, DBUS_TYPE_INVALID)) {
+			done(0, 0);
+			return;
+		}
+		::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+		done(fd, mtu);
+	});
+}
+
+// Hands every queued notification to `cb` without blocking. Returns the
+// number of notifications read, or -1 once the socket has been closed.
+int BleDevice::gatt_notify_drain(int fd, std::vector<uint8_t> &buf, const gatt_notify_cb &cb)
+{
+	int count = 0;
+
+	while (true) {
+		const ssize_t s = ::read(fd, buf.data(), buf.size());
+		if (s > 0) {
+			cb(buf.data(), s);
+			count++;
+		} else if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return count;
+		} else if (s < 0 && errno == EINTR) {
+			continue;
+		} else {
+			return -1;
+		}
+	}
+}
+
+// Returns a socket that writes straight to the characteristic, bypassing
+// WriteValue, or -1 if bluez does not support it for this characteristic
+int BleDevice::gatt_acquire_write(const std::string &charPath, uint16_t *mtu)
+{
+	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
+	DBusError dbus_error;
+	int fd = -1;
+
+	::dbus_error_init(&dbus_error);
+	dbus_msg = this->gatt_message(charPath, "AcquireWrite");
+	if (dbus_msg != nullptr) {
+		dbus_reply = this->dbus_call_block(dbus_msg, DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
+
+		if (dbus_reply != nullptr) {
+			if (!dbus_message_get_args(dbus_reply, &dbus_error, DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_UINT16, mtu,
+						   DBUS_TYPE_INVALID)) {
+				fd = -1;
+			}
+			dbus_message_unref(dbus_reply);
+		} else {
+			syslog(LOG_DEBUG, "DBUS error at %d %s %s", __LINE__, dbus_error.name, dbus_error.message);
+		}
+		if (dbus_error_is_set(&dbus_error)) {
+			dbus_error_free(&dbus_error);
+		}
+		dbus_message_unref(dbus_msg);
+	}
+	return fd;
+}
+
+void BleDevice::gatt_release_fds()
+{
+	for (auto &[path, fd] : this->write_fds) {
+		if (fd >= 0)
+			::close(fd);
+	}
+	this->write_fds.clear();
+}
+
+void BleDevice::link_lost()
+{
+	this->gatt_release_fds();
 }
 
 // PHILIPS_POWER_UUID = "932c32bd-0002-47a2-835a-a8d455b859dd"
@@ -110,16 +418,20 @@ int BleDevice::gatt_notify_char(std::string service, std::string characteristic)
 // busctl introspect org.bluez
 // /org/bluez/hci0/dev_F3_0D_83_C4_62_B1/service002c/char0032
 
-// dbus-send --session           \
-//   --system                    \
-//   --dest=org.bluez            \
-//   --type=method_call          \
-//   --print-reply               \
-//   /org/bluez/hci0/dev_F3_0D_83_C4_62_B1/service002c/char002f    \
-//   org.freedesktop.DBus.Properties.Get string:"org.bluez.GattCharacteristic1" string:"UUID"
+/* dbus-send --session           \
+ *   --system                    \
+ *   --dest=org.bluez            \
+ *   --type=method_call          \
+ *   --print-reply               \
+ *   /org/bluez/hci0/dev_F3_0D_83_C4_62_B1/service002c/char002f    \
+ *   org.freedesktop.DBus.Properties.Get string:"org.bluez.GattCharacteristic1" string:"UUID"
+ */
 
 int BleDevice::device_connected_get()
 {
+	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
+	DBusMessageIter iter0, iter1;
+	DBusError dbus_error;
 	dbus_bool_t dbus_bool = FALSE;
 
 	::dbus_error_init(&dbus_error);
@@ -130,13 +442,13 @@ int BleDevice::device_connected_get()
 		::dbus_message_iter_init_append(dbus_msg, &iter0);
 		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &device);
 		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &connected);
-		dbus_reply = ::dbus_connection_send_with_reply_and_block(bleManager.getConn(), dbus_msg,
-									 2000, // 2 seconds
-									 &dbus_error);
+		dbus_reply = this->dbus_call_block(dbus_msg,
+						   2000, // 2 seconds
+						   &dbus_error);
 		if (dbus_reply != nullptr) {
 			dbus_message_iter_init(dbus_reply, &iter0);
-			dbus_message_iter_recurse(&iter0, &iter2);
-			dbus_message_iter_get_basic(&iter2, &dbus_bool);
+			dbus_message_iter_recurse(&iter0, &iter1);
+			dbus_message_iter_get_basic(&iter1, &dbus_bool);
 			dbus_message_unref(dbus_reply);
 		} else {
 			syslog(LOG_DEBUG, "DBUS error at %d %s %s", __LINE__, dbus_error.name, dbus_error.message);
@@ -154,14 +466,16 @@ int BleDevice::device_connected_get()
 
 int BleDevice::device_connected_set(uint8_t level)
 {
+	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
+	DBusError dbus_error;
 	std::string method = level == 1 ? "Connect" : "Disconnect";
 	::dbus_error_init(&dbus_error);
 
 	dbus_msg = dbus_message_new_method_call("org.bluez", this->devicePath.c_str(), "org.bluez.Device1", method.c_str());
 	if (dbus_msg != nullptr) {
-		dbus_reply = ::dbus_connection_send_with_reply_and_block(bleManager.getConn(), dbus_msg,
-									 2000, // 2 seconds
-									 &dbus_error);
+		dbus_reply = this->dbus_call_block(dbus_msg,
+						   2000, // 2 seconds
+						   &dbus_error);
 		if (dbus_reply == nullptr) {
 			// ::perror(dbus_error.name);
 			// ::perror(dbus_error.message);
@@ -180,9 +494,54 @@ int BleDevice::device_connected_set(uint8_t level)
 
 int BleDevice::device_connect_check()
 {
-	if (!this->device_connected_get()) {
-		syslog(LOG_DEBUG, "%s is disconnected, reconnecting...", this->mac.c_str());
-		this->device_connected_set(1);
-	}
-	return 0;
+	return bleManager.link_acquire(this);
+}
+
+// Connect without blocking, `done` gets 0 once bluez reports the link up or
+// -1 on failure
+void BleDevice::device_connect_async(ble_result_cb done, int timeout_ms)
+{
+	DBusMessage *msg = dbus_message_new_method_call("org.bluez", this->devicePath.c_str(), "org.bluez.Device1",
+							"Connect");
+
+	this->dbus_call(msg, timeout_ms, [done](DBusMessage *reply) { done(reply != nullptr ? 0 : -1); });
+}
+
+// Disconnect without blocking, `done` gets 0 once bluez has dropped the link
+// or -1 on failure
+void BleDevice::device_disconnect_async(ble_result_cb done)
+{
+	DBusMessage *msg = dbus_message_new_method_call("org.bluez", this->devicePath.c_str(), "org.bluez.Device1",
+							"Disconnect");
+
+	this->dbus_call(msg, 2000, [done](DBusMessage *reply) { done(reply != nullptr ? 0 : -1); });
+}
+
+// Get a boolean org.bluez.Device1 property such as "Connected" or
+// "ServicesResolved" without blocking, `done` gets 0, 1 or -1 on failure
+void BleDevice::device_property_async(const char *name, ble_result_cb done)
+{
+	const char *device = "org.bluez.Device1";
+	DBusMessage *msg = dbus_message_new_method_call("org.bluez", this->devicePath.c_str(),
+							"org.freedesktop.DBus.Properties", "Get");
+
+	if (msg != nullptr)
+		dbus_message_append_args(msg, DBUS_TYPE_STRING, &device, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+	this->dbus_call(msg, 2000, [done](DBusMessage *reply) {
+		DBusMessageIter iter0, iter1;
+		dbus_bool_t value = FALSE;
+
+		if (reply == nullptr) {
+			done(-1);
+			return;
+		}
+		dbus_message_iter_init(reply, &iter0);
+		dbus_message_iter_recurse(&iter0, &iter1);
+		if (dbus_message_iter_get_arg_type(&iter1) != DBUS_TYPE_BOOLEAN) {
+			done(-1);
+			return;
+		}
+		dbus_message_iter_get_basic(&iter1, &value);
+		done(value);
+	});
 }
@@ -1,9 +1,12 @@
 #include "BleManager.hpp"
 #include "HueDevice.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <syslog.h>
 #include <unistd.h>
 
-static const char *adapter = "org.bluez.Adapter1";
+static const char *adapter_iface = "org.bluez.Adapter1";
 static const char *property = "Powered";
 
 BleManager bleManager;
@@ -12,39 +15,73 @@ BleManager::BleManager()
 {
 }
 
+thread_local DBusConnection *BleManager::conn = nullptr;
+thread_local std::map<std::string, signal_cb> BleManager::handlers;
+
+// The connection of the calling thread, opened on first use. libdbus
+// connections are not shared between threads, replies and signals are
+// dispatched on the thread that owns the connection. No signals are
+// delivered until objects_watch()/signal_watch() ask for them.
 DBusConnection *BleManager::getConn()
 {
 	DBusError dbus_error;
+
+	if (this->conn != nullptr)
+		return this->conn;
 	dbus_error_init(&dbus_error);
-	int err = 0;
-	if (this->conn == nullptr)
-		err = 1;
-	// if (err == 0) if (!dbus_connection_get_is_connected(this->conn)) err = 1;
-	if (err) {
-		syslog(LOG_DEBUG, "DBUS is not connected, connecting");
-		this->conn = dbus_bus_get(DBUS_BUS_SYSTEM, &dbus_error);
-		if (this->conn == nullptr) {
-			syslog(LOG_DEBUG, "DBUS error at %d %s %s", __LINE__, dbus_error.name, dbus_error.message);
-		}
-		if (dbus_error_is_set(&dbus_error)) {
-			dbus_error_free(&dbus_error);
-		}
+	syslog(LOG_DEBUG, "DBUS is not connected, connecting");
+	this->conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, &dbus_error);
+	if (this->conn == nullptr) {
+		syslog(LOG_DEBUG, "DBUS error at %d %s %s", __LINE__, dbus_error.name, dbus_error.message);
+	}
+	if (dbus_error_is_set(&dbus_error)) {
+		dbus_error_free(&dbus_error);
+	}
+	if (this->conn != nullptr) {
+		dbus_connection_set_exit_on_disconnect(this->conn, FALSE);
+		dbus_connection_add_filter(this->conn, BleManager::signal_filter, this, nullptr);
 	}
-	usleep(100);
 	return this->conn;
 }
 
+// Close the connection of the calling thread, for threads that are done with
+// bluez so signals do not pile up unread on it
+void BleManager::closeConn()
+{
+	if (this->conn == nullptr)
+		return;
+	dbus_connection_close(this->conn);
+	dbus_connection_unref(this->conn);
+	this->conn = nullptr;
+	this->handlers.clear();
+}
+
+// Power on every adapter and record which ones respond, returns the number
+// of adapters that are powered
 int BleManager::ble_power_check()
 {
-	if (!ble_power_get())
-		return ble_power_set(1);
-	return 0;
+	int powered = 0;
+
+	for (auto &adapter : this->adapter_list())
+		powered += this->ble_power_check(adapter);
+	return powered;
+}
+
+bool BleManager::ble_power_check(const std::string &adapter)
+{
+	if (!ble_power_get(adapter))
+		ble_power_set(adapter, 1);
+	bool powered = ble_power_get(adapter);
+
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	this->adapter_healthy[adapter] = powered;
+	return powered;
 }
 
-int BleManager::ble_power_get()
+int BleManager::ble_power_get(const std::string &adapter)
 {
 	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
-	DBusMessageIter iter0, iter1, iter2;
+	DBusMessageIter iter0, iter1;
 	DBusError dbus_error;
 	dbus_bool_t dbus_bool = FALSE;
 	auto connPtr = this->getConn();
@@ -55,12 +92,16 @@ int BleManager::ble_power_get()
 	}
 
 	::dbus_error_init(&dbus_error);
-	dbus_msg = ::dbus_message_new_method_call("org.bluez", "/org/bluez/hci0", "org.freedesktop.DBus.Properties", "Get");
+	dbus_msg = ::dbus_message_new_method_call("org.bluez", adapter.c_str(), "org.freedesktop.DBus.Properties", "Get");
 	if (dbus_msg != nullptr) {
 		::dbus_message_iter_init_append(dbus_msg, &iter0);
-		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &adapter);
+		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &adapter_iface);
 		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &property);
+		auto start = std::chrono::steady_clock::now();
 		dbus_reply = ::dbus_connection_send_with_reply_and_block(connPtr, dbus_msg, DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
+		this->adapter_call(adapter,
+				   std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(),
+				   dbus_error_is_set(&dbus_error) ? dbus_error.name : nullptr);
 
 		if (dbus_error_is_set(&dbus_error)) {
 			dbus_error_free(&dbus_error);
@@ -78,10 +119,10 @@ int BleManager::ble_power_get()
 	return dbus_bool;
 }
 
-int BleManager::ble_power_set(int state)
+int BleManager::ble_power_set(const std::string &adapter, int state)
 {
 	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
-	DBusMessageIter iter0, iter1, iter2;
+	DBusMessageIter iter0, iter1;
 	DBusError dbus_error;
 	dbus_bool_t dbus_bool = state;
 	auto connPtr = this->getConn();
@@ -92,17 +133,21 @@ int BleManager::ble_power_set(int state)
 	}
 
 	::dbus_error_init(&dbus_error);
-	dbus_msg = ::dbus_message_new_method_call("org.bluez", "/org/bluez/hci0", "org.freedesktop.DBus.Properties", "Set");
+	dbus_msg = ::dbus_message_new_method_call("org.bluez", adapter.c_str(), "org.freedesktop.DBus.Properties", "Set");
 
 	if (dbus_msg != nullptr) {
 		::dbus_message_iter_init_append(dbus_msg, &iter0);
-		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &adapter);
+		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &adapter_iface);
 		::dbus_message_iter_append_basic(&iter0, DBUS_TYPE_STRING, &property);
 		::dbus_message_iter_open_container(&iter0, DBUS_TYPE_VARIANT, "b", &iter1);
 		::dbus_message_iter_append_basic(&iter1, DBUS_TYPE_BOOLEAN, &dbus_bool);
 		::dbus_message_iter_close_container(&iter0, &iter1);
 
+		auto start = std::chrono::steady_clock::now();
 		dbus_reply = ::dbus_connection_send_with_reply_and_block(connPtr, dbus_msg, DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
+		this->adapter_call(adapter,
+				   std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(),
+				   dbus_error_is_set(&dbus_error) ? dbus_error.name : nullptr);
 
 		if (dbus_error_is_set(&dbus_error)) {
 			dbus_error_free(&dbus_error);
@@ -114,3 +159,562 @@ int BleManager::ble_power_set(int state)
 	}
 	return 0;
 }
+
+// Record adapters, device RSSI and the UUID of every GattCharacteristic1
+// found in an a{sa{sv}} interface dict
+void BleManager::object_added(const char *path, DBusMessageIter *interfaces)
+{
+	DBusMessageIter iface_entry, props, prop_entry, variant;
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+
+	dbus_message_iter_recurse(interfaces, &iface_entry);
+	while (dbus_message_iter_get_arg_type(&iface_entry) == DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter iface;
+		const char *name = nullptr;
+
+		dbus_message_iter_recurse(&iface_entry, &iface);
+		dbus_message_iter_get_basic(&iface, &name);
+		if (strcmp(name, "org.bluez.Adapter1") == 0) {
+			if (std::find(this->adapters.begin(), this->adapters.end(), path) == this->adapters.end()) {
+				syslog(LOG_NOTICE, "adapter %s", path);
+				this->adapters.push_back(path);
+			}
+		} else if (strcmp(name, "org.bluez.Device1") == 0) {
+			dbus_message_iter_next(&iface);
+			dbus_message_iter_recurse(&iface, &props);
+			while (dbus_message_iter_get_arg_type(&props) == DBUS_TYPE_DICT_ENTRY) {
+				const char *key = nullptr;
+
+				dbus_message_iter_recurse(&props, &prop_entry);
+				dbus_message_iter_get_basic(&prop_entry, &key);
+				if (strcmp(key, "RSSI") == 0) {
+					int16_t value = 0;
+
+					dbus_message_iter_next(&prop_entry);
+					dbus_message_iter_recurse(&prop_entry, &variant);
+					dbus_message_iter_get_basic(&variant, &value);
+					this->rssi[path] = value;
+				}
+				dbus_message_iter_next(&props);
+			}
+		} else if (strcmp(name, "org.bluez.GattCharacteristic1") == 0) {
+			dbus_message_iter_next(&iface);
+			dbus_message_iter_recurse(&iface, &props);
+			while (dbus_message_iter_get_arg_type(&props) == DBUS_TYPE_DICT_ENTRY) {
+				const char *key = nullptr;
+
+				dbus_message_iter_recurse(&props, &prop_entry);
+				dbus_message_iter_get_basic(&prop_entry, &key);
+				if (strcmp(key, "UUID") == 0) {
+					const char *uuid = nullptr;
+					std::string charPath(path);
+					std::string devicePath = charPath.substr(0, charPath.find("/service"));
+
+					dbus_message_iter_next(&prop_entry);
+					dbus_message_iter_recurse(&prop_entry, &variant);
+					dbus_message_iter_get_basic(&variant, &uuid);
+					std::string u(uuid);
+					std::transform(u.begin(), u.end(), u.begin(), ::tolower);
+					this->characteristics[devicePath][u] = charPath;
+					syslog(LOG_DEBUG, "characteristic %s at %s", u.c_str(), path);
+				}
+				dbus_message_iter_next(&props);
+			}
+		}
+		dbus_message_iter_next(&iface_entry);
+	}
+}
+
+void BleManager::object_removed(const char *path)
+{
+	std::string charPath(path);
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+
+	if (std::erase(this->adapters, charPath)) {
+		syslog(LOG_NOTICE, "adapter %s removed", path);
+		this->adapter_healthy[charPath] = false;
+	}
+	auto device = this->characteristics.find(charPath.substr(0, charPath.find("/service")));
+
+	if (device == this->characteristics.end())
+		return;
+	// Removing a device or service path drops every characteristic below it
+	std::erase_if(device->second, [&charPath](auto &e) { return e.second.starts_with(charPath); });
+	if (device->second.empty())
+		this->characteristics.erase(device);
+}
+
+DBusHandlerResult BleManager::signal_filter(DBusConnection *, DBusMessage *msg, void *data)
+{
+	auto self = static_cast<BleManager *>(data);
+	DBusMessageIter iter0;
+	const char *path = nullptr;
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	self->signals_received++;
+	if (dbus_message_is_signal(msg, "org.freedesktop.DBus.ObjectManager", "InterfacesAdded")) {
+		if (dbus_message_iter_init(msg, &iter0)) {
+			dbus_message_iter_get_basic(&iter0, &path);
+			dbus_message_iter_next(&iter0);
+			self->object_added(path, &iter0);
+			self->signals_handled++;
+		}
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+	if (dbus_message_is_signal(msg, "org.freedesktop.DBus.ObjectManager", "InterfacesRemoved")) {
+		if (dbus_message_iter_init(msg, &iter0)) {
+			dbus_message_iter_get_basic(&iter0, &path);
+			self->object_removed(path);
+			self->signals_handled++;
+		}
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+	if (dbus_message_is_signal(msg, "org.freedesktop.DBus.Properties", "PropertiesChanged") &&
+	    dbus_message_get_path(msg) != nullptr) {
+		auto handler = self->handlers.find(dbus_message_get_path(msg));
+
+		if (handler != self->handlers.end()) {
+			handler->second(msg);
+			self->signals_handled++;
+			return DBUS_HANDLER_RESULT_HANDLED;
+		}
+	}
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+void BleManager::match(const std::string &rule, bool add)
+{
+	auto connPtr = this->getConn();
+
+	if (connPtr == nullptr)
+		return;
+	// Without an error argument the call does not wait for the bus daemon
+	if (add)
+		dbus_bus_add_match(connPtr, rule.c_str(), nullptr);
+	else
+		dbus_bus_remove_match(connPtr, rule.c_str(), nullptr);
+}
+
+// Track objects appearing at or disappearing from `path`, and with `subtree`
+// also below it (e.g. the characteristics of a device once it connects)
+void BleManager::objects_watch(const std::string &path, bool subtree, bool add)
+{
+	const std::string rule = "type='signal',sender='org.bluez',interface='org.freedesktop.DBus.ObjectManager',";
+
+	for (const char *member : {"InterfacesAdded", "InterfacesRemoved"}) {
+		this->match(rule + "member='" + member + "',arg0='" + path + "'", add);
+		if (subtree)
+			this->match(rule + "member='" + member + "',arg0path='" + path + "/'", add);
+	}
+}
+
+// Call `handler` on this thread whenever a property of `iface` changes on
+// the object at `path`
+void BleManager::signal_watch(const std::string &path, const std::string &iface, signal_cb handler)
+{
+	this->match("type='signal',sender='org.bluez',interface='org.freedesktop.DBus.Properties',"
+		    "member='PropertiesChanged',path='" +
+			    path + "',arg0='" + iface + "'",
+		    true);
+	this->handlers[path] = handler;
+}
+
+void BleManager::signal_unwatch(const std::string &path, const std::string &iface)
+{
+	this->match("type='signal',sender='org.bluez',interface='org.freedesktop.DBus.Properties',"
+		    "member='PropertiesChanged',path='" +
+			    path + "',arg0='" + iface + "'",
+		    false);
+	this->handlers.erase(path);
+}
+
+// A boolean from the changed properties of a PropertiesChanged signal, -1
+// when the signal does not carry it
+int BleManager::property_bool(DBusMessage *msg, const char *name)
+{
+	DBusMessageIter iter0, props, entry, variant;
+
+	if (!dbus_message_iter_init(msg, &iter0) || !dbus_message_iter_next(&iter0))
+		return -1;
+	dbus_message_iter_recurse(&iter0, &props);
+	while (dbus_message_iter_get_arg_type(&props) == DBUS_TYPE_DICT_ENTRY) {
+		const char *key = nullptr;
+
+		dbus_message_iter_recurse(&props, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+		if (strcmp(key, name) == 0) {
+			dbus_bool_t value = FALSE;
+
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_recurse(&entry, &variant);
+			if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_BOOLEAN)
+				return -1;
+			dbus_message_iter_get_basic(&variant, &value);
+			return value;
+		}
+		dbus_message_iter_next(&props);
+	}
+	return -1;
+}
+
+// Build the UUID -> object path map for every known device in one round-trip
+int BleManager::gatt_discover()
+{
+	DBusMessage *dbus_msg = nullptr, *dbus_reply = nullptr;
+	DBusMessageIter iter0, iter1, iter2;
+	DBusError dbus_error;
+	const char *path = nullptr;
+	auto connPtr = this->getConn();
+	int count = 0;
+
+	if (connPtr == nullptr) {
+		syslog(LOG_DEBUG, "DBUS connection is null");
+		return -1;
+	}
+
+	::dbus_error_init(&dbus_error);
+	dbus_msg = ::dbus_message_new_method_call("org.bluez", "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+	if (dbus_msg != nullptr) {
+		dbus_reply = ::dbus_connection_send_with_reply_and_block(connPtr, dbus_msg, DBUS_TIMEOUT_USE_DEFAULT, &dbus_error);
+
+		if (dbus_reply != nullptr) {
+			dbus_message_iter_init(dbus_reply, &iter0);
+			dbus_message_iter_recurse(&iter0, &iter1);
+			while (dbus_message_iter_get_arg_type(&iter1) == DBUS_TYPE_DICT_ENTRY) {
+				dbus_message_iter_recurse(&iter1, &iter2);
+				dbus_message_iter_get_basic(&iter2, &path);
+				dbus_message_iter_next(&iter2);
+				this->object_added(path, &iter2);
+				dbus_message_iter_next(&iter1);
+				count++;
+			}
+			dbus_message_unref(dbus_reply);
+		} else {
+			syslog(LOG_DEBUG, "DBUS error at %d %s %s", __LINE__, dbus_error.name, dbus_error.message);
+		}
+		if (dbus_error_is_set(&dbus_error)) {
+			dbus_error_free(&dbus_error);
+		}
+		dbus_message_unref(dbus_msg);
+	}
+	return count;
+}
+
+// Dispatch any signals queued on the connection without blocking
+void BleManager::process()
+{
+	auto connPtr = this->getConn();
+
+	if (connPtr == nullptr)
+		return;
+	dbus_connection_read_write(connPtr, 0);
+	while (dbus_connection_dispatch(connPtr) == DBUS_DISPATCH_DATA_REMAINS)
+		;
+}
+
+std::string BleManager::gatt_char_path(const std::string &devicePath, const std::string &uuid)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	auto device = this->characteristics.find(devicePath);
+
+	if (device == this->characteristics.end())
+		return "";
+	auto characteristic = device->second.find(uuid);
+	if (characteristic == device->second.end())
+		return "";
+	return characteristic->second;
+}
+
+// Remember a characteristic path learned in an earlier run. Paths bluez
+// reports always win, a seeded one only fills the gap until the device has
+// resolved its services.
+void BleManager::gatt_char_seed(const std::string &devicePath, const std::string &uuid, const std::string &charPath)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+
+	this->characteristics[devicePath].emplace(uuid, charPath);
+}
+
+std::vector<std::string> BleManager::adapter_list()
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	return this->adapters;
+}
+
+bool BleManager::adapter_ok(const std::string &adapter)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	auto search = this->adapter_healthy.find(adapter);
+
+	if (std::find(this->adapters.begin(), this->adapters.end(), adapter) == this->adapters.end())
+		return false;
+	// Adapters that have not been checked yet get the benefit of the doubt
+	return search == this->adapter_healthy.end() || search->second;
+}
+
+// The adapter has seen the device, in a scan or through its services
+bool BleManager::adapter_reaches(const std::string &adapter, const std::string &mac)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	std::string path = adapter + "/dev_" + mac;
+
+	std::replace(path.begin(), path.end(), ':', '_');
+	return this->rssi.count(path) || this->characteristics.count(path);
+}
+
+int BleManager::adapter_load(const std::string &adapter)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	return std::count_if(this->assignments.begin(), this->assignments.end(),
+			     [&adapter](auto &e) { return e.second == adapter; });
+}
+
+// Pick the adapter a device should be served from. `policy` is one of
+// "static" (use `preferred`, e.g. "hci1"), "least_loaded" or "rssi"; static
+// and rssi fall back to the least loaded healthy adapter. `exclude` skips an
+// adapter that has just failed.
+std::string BleManager::adapter_assign(const std::string &mac, const std::string &policy, const std::string &preferred,
+				       const std::string &exclude)
+{
+	std::string best;
+	std::string dev = mac;
+	int best_load = 0, best_rssi = -128;
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+
+	for (auto &e : dev) {
+		if (e == ':')
+			e = '_';
+	}
+	this->assignments.erase(mac);
+	for (auto &adapter : this->adapters) {
+		if (adapter == exclude || !this->adapter_ok(adapter))
+			continue;
+		if (policy == "static" && !preferred.empty() && adapter == "/org/bluez/" + preferred) {
+			best = adapter;
+			break;
+		}
+		int load = this->adapter_load(adapter);
+		int signal = -128;
+		if (policy == "rssi") {
+			auto search = this->rssi.find(adapter + "/dev_" + dev);
+			if (search != this->rssi.end())
+				signal = search->second;
+		}
+		if (best.empty() || signal > best_rssi || (signal == best_rssi && load < best_load)) {
+			best = adapter;
+			best_load = load;
+			best_rssi = signal;
+		}
+	}
+	if (best.empty())
+		best = BLUEZ_DEFAULT_ADAPTER;
+	this->assignments[mac] = best;
+	syslog(LOG_NOTICE, "%s assigned to %s", mac.c_str(), best.c_str());
+	return best;
+}
+
+bool BleManager::link_held(BleDevice *device)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	return std::find(this->links.begin(), this->links.end(), device) != this->links.end();
+}
+
+// Bump a pooled device to the front and return true, or make room for it by
+// evicting the lowest priority, least recently used link on the same adapter
+// when that is at max_links. The evicted link is returned in `victim` and
+// still has to be disconnected.
+bool BleManager::link_reserve(BleDevice *device, BleDevice *&victim)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	auto search = std::find(this->links.begin(), this->links.end(), device);
+
+	victim = nullptr;
+	if (search != this->links.end()) {
+		this->links.splice(this->links.begin(), this->links, search);
+		this->pool.hits++;
+		return true;
+	}
+
+	auto same_adapter = [device](BleDevice *d) { return d->adapterPath == device->adapterPath; };
+	if (this->max_links > 0 &&
+	    std::count_if(this->links.begin(), this->links.end(), same_adapter) >= this->max_links) {
+		// Walk from least to most recently used so ties go to the oldest link
+		for (auto it = this->links.rbegin(); it != this->links.rend(); it++) {
+			if (same_adapter(*it) && (victim == nullptr || (*it)->priority < victim->priority))
+				victim = *it;
+		}
+		if (victim != nullptr) {
+			syslog(LOG_NOTICE, "evicting %s for %s", victim->mac.c_str(), device->mac.c_str());
+			this->link_release(victim);
+			this->pool.evictions++;
+		}
+	}
+	return false;
+}
+
+// Pool a device that is connected now. `ms` is how long Connect took, or
+// negative when bluez already had the link up; only a Connect we issued
+// counts as a miss.
+void BleManager::link_add(BleDevice *device, double ms)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+
+	if (ms < 0) {
+		this->pool.hits++;
+	} else {
+		this->pool.misses++;
+		this->pool.connect_ms_total += ms;
+		this->pool.connect_ms_max = std::max(this->pool.connect_ms_max, ms);
+	}
+	if (std::find(this->links.begin(), this->links.end(), device) == this->links.end())
+		this->links.push_front(device);
+}
+
+// Make sure the device has a live link. Pooled devices are trusted to be
+// connected (drops are found by the periodic connection check); anything
+// else is connected on demand. The lock is not held while talking to bluez,
+// only the worker of an adapter touches its links so the victim cannot
+// change meanwhile.
+int BleManager::link_acquire(BleDevice *device)
+{
+	BleDevice *victim;
+
+	if (this->link_reserve(device, victim))
+		return 0;
+	if (victim != nullptr)
+		victim->device_connected_set(0);
+	if (device->device_connected_get()) {
+		this->link_add(device, -1);
+		return 0;
+	}
+	syslog(LOG_DEBUG, "%s is disconnected, connecting...", device->mac.c_str());
+	auto start = std::chrono::steady_clock::now();
+	device->device_connected_set(1);
+	if (!device->device_connected_get())
+		return -1;
+	this->link_add(device, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	return 0;
+}
+
+// link_acquire() without blocking the worker. A cold connect gets the full
+// timeout of device_connect_async(), bulbs often need more than the two
+// seconds of a blocking call. `done` gets 0 once the device is pooled, or -1.
+void BleManager::link_acquire_async(BleDevice *device, std::function<void(int err)> done)
+{
+	BleDevice *victim;
+
+	if (this->link_reserve(device, victim)) {
+		done(0);
+		return;
+	}
+	auto connect = [this, device, done](int) {
+		device->device_property_async("Connected", [this, device, done](int connected) {
+			if (connected == 1) {
+				this->link_add(device, -1);
+				done(0);
+				return;
+			}
+			syslog(LOG_DEBUG, "%s is disconnected, connecting...", device->mac.c_str());
+			auto start = std::chrono::steady_clock::now();
+			device->device_connect_async([this, device, done, start](int err) {
+				if (err < 0) {
+					done(-1);
+					return;
+				}
+				this->link_add(device, std::chrono::duration<double, std::milli>(
+							       std::chrono::steady_clock::now() - start)
+							       .count());
+				done(0);
+			});
+		});
+	};
+	if (victim != nullptr)
+		victim->device_disconnect_async(connect);
+	else
+		connect(0);
+}
+
+void BleManager::link_release(BleDevice *device)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	this->links.remove(device);
+	device->link_lost();
+}
+
+BleManager::pool_stats BleManager::pool_get()
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	pool_stats stats = this->pool;
+
+	stats.links = this->links.size();
+	return stats;
+}
+
+// Record a D-Bus call made for `adapter` or one of its devices. `error` is
+// the D-Bus error name, or nullptr on success.
+void BleManager::adapter_call(const std::string &adapter, double ms, const char *error)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	auto &stats = this->health[adapter];
+	auto &window = this->windows[adapter];
+	auto now = std::chrono::steady_clock::now();
+	bool timeout = error != nullptr && (strcmp(error, DBUS_ERROR_NO_REPLY) == 0 || strcmp(error, DBUS_ERROR_TIMEOUT) == 0 ||
+					    strcmp(error, DBUS_ERROR_TIMED_OUT) == 0);
+
+	stats.calls++;
+	stats.errors += error != nullptr;
+	stats.timeouts += timeout;
+	stats.latency_ms_total += ms;
+	stats.latency_ms_max = std::max(stats.latency_ms_max, ms);
+
+	if (now - window.start > std::chrono::seconds(30)) {
+		window.previous_calls = window.calls;
+		window.previous_timeouts = window.timeouts;
+		window.calls = window.timeouts = 0;
+		window.start = now;
+	}
+	window.calls++;
+	window.timeouts += timeout;
+}
+
+// An adapter is wedged when bluez leaves most calls for it unanswered over
+// the last 30 to 60 seconds. Errors bluez does answer (a bulb out of range)
+// say nothing about the adapter. At most one recovery a minute.
+bool BleManager::adapter_failing(const std::string &adapter)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	auto &window = this->windows[adapter];
+	auto now = std::chrono::steady_clock::now();
+	unsigned int calls = window.calls + window.previous_calls;
+	unsigned int timeouts = window.timeouts + window.previous_timeouts;
+
+	if (now - window.recovered < std::chrono::seconds(60) || now - window.start > std::chrono::seconds(60))
+		return false;
+	if (now - window.start > std::chrono::seconds(30)) {
+		// The previous window is over a minute old
+		calls = window.calls;
+		timeouts = window.timeouts;
+	}
+	return calls >= 3 && timeouts * 10 >= calls * 8;
+}
+
+void BleManager::adapter_recovered(const std::string &adapter, double ms, unsigned int lost, unsigned int restored)
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	auto &stats = this->health[adapter];
+	auto &window = this->windows[adapter];
+
+	stats.recoveries++;
+	stats.recovery_ms_last = ms;
+	stats.links_lost_last = lost;
+	stats.links_restored_last = restored;
+	window = {};
+	window.start = window.recovered = std::chrono::steady_clock::now();
+}
+
+std::map<std::string, BleManager::adapter_stats> BleManager::adapter_stats_get()
+{
+	std::lock_guard<std::recursive_mutex> guard(this->lock);
+	return this->health;
+}
@@ -0,0 +1,92 @@
+#include "BleScheduler.hpp"
+#include <algorithm>
+
+// Relative airtime of each operation class, a connection attempt keeps the
+// controller busy for far longer than a single read or write
+static const int op_cost[BLE_OP_CLASSES] = {1, 1, 4};
+
+void BleScheduler::submit(BleDevice *device, BleOpClass cls, ble_op_run run)
+{
+	auto &adapter = this->adapters[device->adapterPath];
+	auto &queue = adapter.queues[cls][device];
+
+	if (queue.ops.empty())
+		adapter.ring[cls].push_back(device);
+	queue.ops.push_back({run, op_cost[cls], std::chrono::steady_clock::now()});
+}
+
+// Pick the next operation of the highest priority class that has any, using
+// deficit round robin between the bulbs queued in that class
+bool BleScheduler::next(adapter_queue &adapter, op_s &op, int &cls)
+{
+	for (cls = 0; cls < BLE_OP_CLASSES; cls++) {
+		auto &ring = adapter.ring[cls];
+
+		while (!ring.empty()) {
+			auto device = ring.front();
+			auto &queue = adapter.queues[cls][device];
+
+			if (queue.ops.empty()) {
+				ring.pop_front();
+				adapter.queues[cls].erase(device);
+				continue;
+			}
+			if (queue.deficit < queue.ops.front().cost) {
+				// Out of airtime for this round, credit it and move on
+				queue.deficit += this->quantum;
+				ring.pop_front();
+				ring.push_back(device);
+				continue;
+			}
+			queue.deficit -= queue.ops.front().cost;
+			op = std::move(queue.ops.front());
+			queue.ops.pop_front();
+			if (queue.ops.empty()) {
+				ring.pop_front();
+				adapter.queues[cls].erase(device);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// Start queued operations on every adapter up to max_in_flight, returns the
+// number of operations started
+int BleScheduler::dispatch()
+{
+	int started = 0;
+
+	for (auto &[path, adapter] : this->adapters) {
+		op_s op;
+		int cls = 0;
+
+		while (adapter.inFlight < this->max_in_flight && this->next(adapter, op, cls)) {
+			auto &s = this->stats[cls];
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - op.queued)
+					    .count();
+
+			s.dispatched++;
+			s.wait_ms_total += ms;
+			s.wait_ms_max = std::max(s.wait_ms_max, ms);
+			adapter.inFlight++;
+			started++;
+			auto *inFlight = &adapter.inFlight;
+			op.run([inFlight]() { (*inFlight)--; });
+		}
+	}
+	return started;
+}
+
+size_t BleScheduler::queued()
+{
+	size_t count = 0;
+
+	for (auto &[path, adapter] : this->adapters) {
+		for (auto &queues : adapter.queues) {
+			for (auto &[device, queue] : queues)
+				count += queue.ops.size();
+		}
+	}
+	return count;
+}
@@ -1,45 +1,176 @@
 #include "HueDevice.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
+#include <memory>
+#include <unistd.h>
 
-HueDevice::HueDevice(std::string mac)
-    : BleDevice(mac), power(this), brightness(this) {}
+HueDevice::HueDevice(std::string mac, std::string adapter)
+    : BleDevice(mac, adapter), power(this), brightness(this) {}
+
+std::string HueDevice::light_power_path() {
+  return gatt_char_path(PHILIPS_POWER_UUID, "/service002c/char002f");
+}
+
+std::string HueDevice::light_brightness_path() {
+  return gatt_char_path(PHILIPS_LEVEL_UUID, "/service002c/char0032");
+}
+
+// Empty when the bulb has no combined control characteristic
+std::string HueDevice::light_control_path() {
+  return bleManager.gatt_char_path(this->devicePath, PHILIPS_CONTROL_UUID);
+}
+
+std::vector<uint8_t> HueDevice::light_control_encode(const LightState &state) {
+  std::vector<uint8_t> tlv;
+
+  if (state.power) {
+    tlv.insert(tlv.end(), {PHILIPS_CONTROL_POWER, 1, *state.power});
+  }
+  if (state.brightness) {
+    tlv.insert(tlv.end(), {PHILIPS_CONTROL_BRIGHTNESS, 1,
+                           std::min<uint8_t>(*state.brightness, 0xFE)});
+  }
+  if (state.mireds) {
+    tlv.insert(tlv.end(), {PHILIPS_CONTROL_MIREDS, 2,
+                           (uint8_t)(*state.mireds & 0xFF),
+                           (uint8_t)(*state.mireds >> 8)});
+  }
+  if (state.transition) {
+    tlv.insert(tlv.end(), {PHILIPS_CONTROL_TRANSITION, 2,
+                           (uint8_t)(*state.transition & 0xFF),
+                           (uint8_t)(*state.transition >> 8)});
+  }
+  return tlv;
+}
+
+// Change several attributes at once over a link the caller holds. Uses a
+// single write to the combined control characteristic when the bulb has one,
+// otherwise writes power and brightness separately. Without it a colour
+// temperature fails with -ENOTSUP before anything is written, a transition
+// is ignored. `done` is called once with the first error, or 0 when every
+// write succeeded. Returns -1 if nothing could be submitted.
+int HueDevice::apply(const LightState &state, gatt_write_cb done) {
+  auto control = light_control_path();
+  if (!control.empty()) {
+    auto tlv = light_control_encode(state);
+    return this->gatt_write_char(control, tlv.data(), tlv.size(), done);
+  }
+  if (state.mireds) {
+    if (done) {
+      done(-ENOTSUP);
+    }
+    return -1;
+  }
+
+  struct result {
+    int outstanding = 0;
+    int err = 0;
+    gatt_write_cb done;
+  };
+  auto res = std::make_shared<result>();
+  res->outstanding = state.power.has_value() + state.brightness.has_value();
+  res->done = done;
+  // Errors win over unacknowledged writes
+  auto complete = [res](int err) {
+    if (err != 0 && res->err >= 0) {
+      res->err = err;
+    }
+    if (--res->outstanding == 0 && res->done) {
+      res->done(res->err);
+    }
+  };
+  if (res->outstanding == 0) {
+    if (done) {
+      done(0);
+    }
+    return 0;
+  }
+  if (state.power) {
+    this->gatt_write_char_byte(light_power_path(),
+                               std::min<uint8_t>(*state.power, 0xFE), complete);
+  }
+  if (state.brightness) {
+    this->gatt_write_char_byte(light_brightness_path(), *state.brightness,
+                               complete);
+  }
+  return 0;
+}
+
+// The single attribute calls below take the link themselves, -1 when the
+// device cannot be connected
 
 int HueDevice::light_power_get() {
-  device_connect_check();
-  return this->gatt_read_char_byte("002c", "002f");
+  if (device_connect_check() != 0) {
+    return -1;
+  }
+  return this->gatt_read_char_byte(light_power_path());
 }
 
-int HueDevice::light_power_set(uint8_t level) {
-  device_connect_check();
+int HueDevice::light_power_set(uint8_t level, gatt_write_cb done) {
+  if (device_connect_check() != 0) {
+    if (done) {
+      done(-1);
+    }
+    return -1;
+  }
   if (level >= 0xFE)
     level = 0xFE;
-  return this->gatt_write_char_byte("002c", "002f", level);
+  return this->gatt_write_char_byte(light_power_path(), level, done);
 }
 
 int HueDevice::light_power_notify_get() {
   if (this->light_power_fd == 0) {
-    this->light_power_fd = this->gatt_notify_char("002c", "002f");
+    uint16_t mtu = 0;
+    this->light_power_fd = this->gatt_notify_char(light_power_path(), &mtu);
+    this->light_power_buf.resize(mtu > 0 ? mtu : 512);
   }
   return this->light_power_fd;
 }
 
 int HueDevice::light_brightness_get() {
-  device_connect_check();
-  return this->gatt_read_char_byte("002c", "0032");
+  if (device_connect_check() != 0) {
+    return -1;
+  }
+  return this->gatt_read_char_byte(light_brightness_path());
 }
 
-int HueDevice::light_brightness_set(uint8_t level) {
-  device_connect_check();
-  return this->gatt_write_char_byte("002c", "0032", level);
+int HueDevice::light_brightness_set(uint8_t level, gatt_write_cb done) {
+  if (device_connect_check() != 0) {
+    if (done) {
+      done(-1);
+    }
+    return -1;
+  }
+  return this->gatt_write_char_byte(light_brightness_path(), level, done);
 }
 
 int HueDevice::light_brightness_notify_get() {
   if (this->light_brightness_fd == 0) {
-    this->light_brightness_fd = this->gatt_notify_char("002c", "0032");
+    uint16_t mtu = 0;
+    this->light_brightness_fd =
+        this->gatt_notify_char(light_brightness_path(), &mtu);
+    this->light_brightness_buf.resize(mtu > 0 ? mtu : 512);
   }
   return this->light_brightness_fd;
 }
 
+void HueDevice::light_notify_release() {
+  if (this->light_power_fd > 0) {
+    close(this->light_power_fd);
+  }
+  if (this->light_brightness_fd > 0) {
+    close(this->light_brightness_fd);
+  }
+  this->light_power_fd = 0;
+  this->light_brightness_fd = 0;
+}
+
+void HueDevice::link_lost() {
+  light_notify_release();
+  BleDevice::link_lost();
+}
+
 HueDevice::Power::Power(HueDevice *p) : parent(p) {}
 
 void HueDevice::Power::operator=(const uint8_t level) {
@@ -0,0 +1,250 @@
+#include "LightCache.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <vector>
+
+// File layout, integers little endian, strings as a u16 length and bytes:
+//   "H2MC" u8 version u16 count
+//   count * { str mac, str adapter, u16 mtu, u8 power, u8 brightness,
+//             u16 mireds, u64 time, u8 paths, paths * { str uuid, str path },
+//             u8 usage[7 * 24] }
+// A power or brightness of 0xFF and mireds of 0xFFFF are unknown. Version 1
+// files have no usage, versions 1 and 2 no mireds.
+#define CACHE_MAGIC "H2MC"
+#define CACHE_VERSION 3
+#define CACHE_UNKNOWN 0xFF
+#define CACHE_UNKNOWN_MIREDS 0xFFFF
+
+static void put_int(std::vector<uint8_t> &buf, uint64_t value, int size)
+{
+	for (int i = 0; i < size; i++)
+		buf.push_back(value >> (8 * i));
+}
+
+static void put_str(std::vector<uint8_t> &buf, const std::string &s)
+{
+	put_int(buf, s.size(), 2);
+	buf.insert(buf.end(), s.begin(), s.end());
+}
+
+// Reads advance `pos` and return false once the buffer is exhausted
+static bool get_int(const std::vector<uint8_t> &buf, size_t &pos, uint64_t &value, int size)
+{
+	if (pos + size > buf.size())
+		return false;
+	value = 0;
+	for (int i = 0; i < size; i++)
+		value |= (uint64_t)buf[pos++] << (8 * i);
+	return true;
+}
+
+static bool get_str(const std::vector<uint8_t> &buf, size_t &pos, std::string &s)
+{
+	uint64_t len;
+
+	if (!get_int(buf, pos, len, 2) || pos + len > buf.size())
+		return false;
+	s.assign(buf.begin() + pos, buf.begin() + pos + len);
+	pos += len;
+	return true;
+}
+
+// Reads one bulb, false when the entry is cut short
+static bool get_entry(const std::vector<uint8_t> &buf, size_t &pos, uint64_t version, std::string &mac,
+		      LightCache::entry &e)
+{
+	uint64_t mtu, power, brightness, mireds = CACHE_UNKNOWN_MIREDS, time, paths;
+
+	if (!get_str(buf, pos, mac) || !get_str(buf, pos, e.adapter) || !get_int(buf, pos, mtu, 2) ||
+	    !get_int(buf, pos, power, 1) || !get_int(buf, pos, brightness, 1) ||
+	    (version >= 3 && !get_int(buf, pos, mireds, 2)) || !get_int(buf, pos, time, 8) ||
+	    !get_int(buf, pos, paths, 1))
+		return false;
+	for (uint64_t j = 0; j < paths; j++) {
+		std::string uuid, path;
+
+		if (!get_str(buf, pos, uuid) || !get_str(buf, pos, path))
+			return false;
+		e.paths[uuid] = path;
+	}
+	for (int hour = 0; version >= 2 && hour < LIGHT_CACHE_HOURS; hour++) {
+		uint64_t count;
+
+		if (!get_int(buf, pos, count, 1))
+			return false;
+		e.usage[hour] = count;
+	}
+	e.mtu = mtu;
+	if (power != CACHE_UNKNOWN)
+		e.state.power = power;
+	if (brightness != CACHE_UNKNOWN)
+		e.state.brightness = brightness;
+	if (mireds != CACHE_UNKNOWN_MIREDS)
+		e.state.mireds = mireds;
+	e.time = time;
+	return true;
+}
+
+// Returns the number of bulbs loaded, or -1 when the file is missing or
+// not a cache. A truncated file keeps the bulbs read before the damage.
+int LightCache::load(const std::string &file)
+{
+	std::vector<uint8_t> buf;
+	uint8_t chunk[4096];
+	uint64_t version, count;
+	size_t pos = 4;
+	int fd = ::open(file.c_str(), O_RDONLY);
+	ssize_t len;
+
+	if (fd < 0)
+		return -1;
+	while ((len = ::read(fd, chunk, sizeof(chunk))) > 0)
+		buf.insert(buf.end(), chunk, chunk + len);
+	::close(fd);
+
+	if (buf.size() < 4 || std::string(buf.begin(), buf.begin() + 4) != CACHE_MAGIC ||
+	    !get_int(buf, pos, version, 1) || version < 1 || version > CACHE_VERSION || !get_int(buf, pos, count, 2)) {
+		syslog(LOG_NOTICE, "ignoring cache %s", file.c_str());
+		return -1;
+	}
+
+	this->entries.clear();
+	for (uint64_t i = 0; i < count; i++) {
+		std::string mac;
+		entry e;
+
+		if (!get_entry(buf, pos, version, mac, e))
+			break;
+		this->entries[mac] = e;
+	}
+	this->dirty = false;
+	return this->entries.size();
+}
+
+// Write the cache next to `file` and rename it into place, so a crash or
+// power loss leaves either the old or the new cache
+int LightCache::save(const std::string &file)
+{
+	std::vector<uint8_t> buf(CACHE_MAGIC, CACHE_MAGIC + 4);
+	std::string tmp = file + ".tmp";
+	size_t done = 0;
+	int fd;
+
+	put_int(buf, CACHE_VERSION, 1);
+	put_int(buf, this->entries.size(), 2);
+	for (auto &[mac, e] : this->entries) {
+		put_str(buf, mac);
+		put_str(buf, e.adapter);
+		put_int(buf, e.mtu, 2);
+		put_int(buf, e.state.power.value_or(CACHE_UNKNOWN), 1);
+		put_int(buf, e.state.brightness.value_or(CACHE_UNKNOWN), 1);
+		put_int(buf, e.state.mireds.value_or(CACHE_UNKNOWN_MIREDS), 2);
+		put_int(buf, e.time, 8);
+		put_int(buf, e.paths.size(), 1);
+		for (auto &[uuid, path] : e.paths) {
+			put_str(buf, uuid);
+			put_str(buf, path);
+		}
+		buf.insert(buf.end(), e.usage.begin(), e.usage.end());
+	}
+
+	fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		syslog(LOG_ERR, "cannot write cache %s: %d", tmp.c_str(), errno);
+		return -1;
+	}
+	while (done < buf.size()) {
+		ssize_t len = ::write(fd, buf.data() + done, buf.size() - done);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		done += len;
+	}
+	if (done < buf.size() || ::fsync(fd) < 0) {
+		syslog(LOG_ERR, "cannot write cache %s: %d", tmp.c_str(), errno);
+		::close(fd);
+		::unlink(tmp.c_str());
+		return -1;
+	}
+	::close(fd);
+	if (::rename(tmp.c_str(), file.c_str()) < 0) {
+		syslog(LOG_ERR, "cannot replace cache %s: %d", file.c_str(), errno);
+		::unlink(tmp.c_str());
+		return -1;
+	}
+	this->dirty = false;
+	return 0;
+}
+
+const LightCache::entry *LightCache::find(const std::string &mac)
+{
+	auto search = this->entries.find(mac);
+
+	return search == this->entries.end() ? nullptr : &search->second;
+}
+
+void LightCache::adapter_set(const std::string &mac, const std::string &adapter)
+{
+	auto &e = this->entries[mac];
+
+	this->dirty |= e.adapter != adapter;
+	e.adapter = adapter;
+}
+
+void LightCache::path_set(const std::string &mac, const std::string &uuid, const std::string &path)
+{
+	auto &e = this->entries[mac];
+
+	if (path.empty())
+		return;
+	this->dirty |= e.paths[uuid] != path;
+	e.paths[uuid] = path;
+}
+
+void LightCache::mtu_set(const std::string &mac, uint16_t mtu)
+{
+	auto &e = this->entries[mac];
+
+	this->dirty |= e.mtu != mtu;
+	e.mtu = mtu;
+}
+
+void LightCache::state_set(const std::string &mac, const LightState &state)
+{
+	auto &e = this->entries[mac];
+	bool changed = false;
+
+	if (state.power && state.power != e.state.power) {
+		e.state.power = state.power;
+		changed = true;
+	}
+	if (state.brightness && state.brightness != e.state.brightness) {
+		e.state.brightness = state.brightness;
+		changed = true;
+	}
+	if (state.mireds && state.mireds != e.state.mireds) {
+		e.state.mireds = state.mireds;
+		changed = true;
+	}
+	if (changed) {
+		e.time = ::time(nullptr);
+		this->dirty = true;
+	}
+}
+
+void LightCache::usage_add(const std::string &mac, int hour)
+{
+	auto &usage = this->entries[mac].usage;
+
+	if (usage[hour] == 255) {
+		// Keep the shape, let old weeks fade
+		for (auto &count : usage)
+			count /= 2;
+	}
+	usage[hour]++;
+	this->dirty = true;
+}
@@ -0,0 +1,55 @@
+#include "LinkMonitor.hpp"
+
+// Longest wait for the disconnect of a link cycled on purpose
+#define LINK_CYCLE_TIMEOUT std::chrono::seconds(10)
+#define LINK_HISTORY 8
+
+// A link came up
+void LinkMonitor::up(time_point now)
+{
+	this->linkUp = now;
+	this->lastTraffic = now;
+}
+
+void LinkMonitor::traffic(time_point now)
+{
+	this->lastTraffic = now;
+}
+
+// The link is about to be dropped and reconnected on purpose. Its
+// disconnect may only be reported after the new link is up.
+void LinkMonitor::cycle(time_point now)
+{
+	this->cycle_pending = true;
+	this->cycle_deadline = now + LINK_CYCLE_TIMEOUT;
+}
+
+bool LinkMonitor::cycling(time_point now) const
+{
+	return this->cycle_pending && now < this->cycle_deadline;
+}
+
+// Bluez reported the link down. Returns true when the bulb dropped a `held`
+// link, which the caller releases and reconnects. The disconnect of a cycle
+// only ends the cycle. A drop after an idle time the keep-alive would have
+// covered tells how long the bulb tolerates idle links; one despite recent
+// traffic tells how old its links get.
+bool LinkMonitor::dropped(time_point now, bool held, int keepalive_ms)
+{
+	const bool cycled = this->cycling(now);
+
+	this->cycle_pending = false;
+	if (cycled || !held)
+		return false;
+
+	double idle = std::chrono::duration<double>(now - this->lastTraffic).count();
+	double age = std::chrono::duration<double>(now - this->linkUp).count();
+	const bool busy = keepalive_ms > 0 && idle * 1000 < keepalive_ms;
+	auto &history = busy ? this->dropAge : this->dropIdle;
+
+	this->drops++;
+	history.push_back(busy ? age : idle);
+	if (history.size() > LINK_HISTORY)
+		history.pop_front();
+	return true;
+}
@@ -3,29 +3,113 @@
 // 3. Add device to this list
 
 #include <algorithm>
+#include <atomic>
+#include <boost/lockfree/queue.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <chrono>
+#include <deque>
 #include <dbus/dbus.h>
 #include <fstream>
 #include <ifaddrs.h>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <syslog.h>
 #include <thread>
+#include <time.h>
 #include <unistd.h>
 
+#include "Awaitable.hpp"
 #include "mqtt.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/this_coro.hpp>
 #include <json.hpp>
 
 #include <BleDevice.hpp>
 #include <BleManager.hpp>
+#include <BleScheduler.hpp>
 #include <HueDevice.hpp>
+#include <LightCache.hpp>
+#include <LinkMonitor.hpp>
 
 using namespace std;
 using nlohmann::json;
+using boost::asio::awaitable;
+using boost::asio::use_awaitable;
+
+// A group or scene command in flight, from its first write to the last
+// member confirming it. Owned by the MQTT thread, workers only pass it back
+// in events.
+struct group_op_s {
+  std::string name;
+  unsigned int members = 0;
+  unsigned int outstanding = 0;
+  unsigned int failed = 0;
+  std::chrono::steady_clock::time_point firstWrite;
+  bool written = false;
+};
+
+// A write and its hedge on a second adapter racing to be confirmed, the
+// first success settles it. Only touched by the worker of the light.
+struct write_race_s {
+  LightState state;
+  std::vector<group_op_s *> groups;
+  std::chrono::steady_clock::time_point start;
+  // Sides still running, a write waiting for its confirmation included
+  int outstanding = 1;
+  bool settled = false;
+  // The write went out and waits for the bulb to notify or be read back
+  bool confirming = false;
+  // A hedge was sent, or no other adapter could take one
+  bool hedged = false;
+  // The bulb on the adapter of the hedge. Kept out of the connection pool,
+  // which only the worker of that adapter manages.
+  std::unique_ptr<HueDevice> hedge;
+};
 
 typedef struct hue_device_handle_s {
-  HueDevice *device;
-  unsigned int nextAvailable;
-  unsigned int nextBrightness;
-  unsigned int nextPower;
+  HueDevice *device = nullptr;
+  // Reported state changed and needs publishing
+  unsigned int nextAvailable = 0;
+  // Last state notified by or read from the bulb
+  LightState reported{};
+  // State requested by commands. Fields are cleared once the bulb reports
+  // them, the rest is dropped after desiredDeadline.
+  LightState desired{};
+  std::chrono::steady_clock::time_point desiredDeadline{};
+  // Values written but not yet confirmed by a notification (-1 when idle)
+  int expectPower = -1;
+  int expectBrightness = -1;
+  std::chrono::steady_clock::time_point expectDeadline{};
+  // Group and scene commands waiting for the desired state to be written
+  std::vector<group_op_s *> pendingGroups{};
+  unsigned int writesInFlight = 0;
+  std::chrono::steady_clock::time_point lastWrite{};
+  // A write could not connect, it is retried from then on
+  std::chrono::steady_clock::time_point writeRetry{};
+  // Operations waiting in the scheduler
+  bool writeQueued = false;
+  bool readQueued = false;
+  bool connectQueued = false;
+  // light_start() has not finished yet
+  bool starting = false;
+  // Reported state was recovered from MQTT or the cache, not read from the
+  // bulb yet
+  bool stale = false;
+  // Link supervision, see light_supervise()
+  LinkMonitor link{};
+  // Notification sockets are being acquired; a failed acquisition is tried
+  // again at notifyRetry, backing off up to a minute until the next link
+  bool notifyPending = false;
+  std::chrono::steady_clock::time_point notifyRetry{};
+  std::chrono::milliseconds notifyBackoff{0};
+  // Write in flight that may still be hedged
+  std::shared_ptr<write_race_s> race{};
+  unsigned int hedgesInFlight = 0;
+  // Adapter a hedge moved the link to, the light follows once idle
+  std::string moveTo{};
 } hue_device_handle;
 
 struct hue_config_s {
@@ -35,6 +119,27 @@ struct hue_config_s {
   std::string set_topic;
   std::string status_topic;
   std::string mac;
+  // Adapter name (e.g. "hci1") for the "static" adapter policy
+  std::string adapter;
+  // Higher priority bulbs keep their link longest in connection pool mode
+  int priority = 0;
+  // Minimum time between status publishes, -1 uses the global setting
+  int status_interval_ms = -1;
+};
+
+// Lights switched together through one set_topic, commands use the same
+// payloads as a single light
+struct group_config_s {
+  std::string name;
+  std::string set_topic;
+  std::vector<std::string> members;
+};
+
+// Any message on set_topic applies a stored state to each member light
+struct scene_config_s {
+  std::string name;
+  std::string set_topic;
+  std::vector<std::pair<std::string, json>> states;
 };
 
 struct config_s {
@@ -42,11 +147,55 @@ struct config_s {
   std::string mqtt_user;
   std::string mqtt_pass;
   std::string client_name;
+  // "notify": a write is applied when the bulb notifies the new value
+  // "write": a write is applied when bluez acknowledges it
+  std::string confirm = "notify";
+  int confirm_timeout_ms = 1000;
+  // How bulbs are spread over adapters: "static", "least_loaded" or "rssi"
+  std::string adapter_policy = "least_loaded";
+  // Connected bulbs per adapter before the least recently used is dropped,
+  // 0 keeps every bulb connected
+  int max_links = 0;
+  // Seconds between bridge statistics publishes
+  int stats_interval = 60;
+  // Minimum time between writes to the same bulb, commands arriving faster
+  // are coalesced and only the newest state is written
+  int min_write_interval_ms = 100;
+  // BLE operations running at once per adapter
+  int max_in_flight = 2;
+  // Commands not written within this time are dropped, unless the MQTT v5
+  // Message Expiry Interval of the command says otherwise
+  int command_deadline_ms = 10000;
+  // Seconds after which unchanged retained topics are published again
+  int heartbeat_interval = 300;
+  // Minimum time between status publishes of one light, intermediate states
+  // are skipped and the newest is always published when the interval ends
+  int status_interval_ms = 250;
+  // Idle links are kept up by reading a characteristic this often, 0 leaves
+  // them alone. Bulbs that dropped idle links sooner are read more often.
+  int keepalive_interval_ms = 20000;
+  // Every this many minutes the bulbs usually commanded in the coming
+  // window are connected ahead of time, 0 disables it
+  int warmup_window_min = 30;
+  // Weeks a bulb must have been used in an hour to be warmed up for it
+  int warmup_min_weeks = 2;
+  // Writes not confirmed within the p95 write latency of their adapter are
+  // sent again through another adapter that can reach the bulb
+  bool hedge_writes = false;
+  // Adapter, characteristics and last state of every bulb are kept here
+  // between runs, empty disables the cache
+  std::string cache_file = "/var/lib/hue2mqtt.cache";
   std::vector<struct hue_config_s> hue_lights;
+  std::vector<struct group_config_s> groups;
+  std::vector<struct scene_config_s> scenes;
 
   string toString() {
     string res = "mqtt_host: " + mqtt_host + "\n";
     res += "mqtt_user: " + mqtt_user + "\n";
+    res += "confirm: " + confirm + "\n";
+    res += "adapter_policy: " + adapter_policy + "\n";
+    res += "max_links: " + to_string(max_links) + "\n";
+    res += "cache_file: " + cache_file + "\n";
     for (auto &light : hue_lights) {
       res += "config_topic: " + light.config_topic + "\n";
       res += "availability_topic: " + light.availability_topic + "\n";
@@ -54,6 +203,13 @@ struct config_s {
       res += "status_topic: " + light.status_topic + "\n";
       res += "mac: " + light.mac + "\n";
       res += "name: " + light.name + "\n";
+      res += "adapter: " + light.adapter + "\n";
+    }
+    for (auto &group : groups) {
+      res += "group: " + group.name + " set_topic: " + group.set_topic + "\n";
+    }
+    for (auto &scene : scenes) {
+      res += "scene: " + scene.name + " set_topic: " + scene.set_topic + "\n";
     }
     return res;
   }
@@ -64,17 +220,1748 @@ void from_json(const json &j, struct config_s &c) {
   j.at("mqtt_user").get_to(c.mqtt_user);
   j.at("mqtt_pass").get_to(c.mqtt_pass);
   j.at("client_name").get_to(c.client_name);
+  if (j.contains("confirm")) {
+    j.at("confirm").get_to(c.confirm);
+  }
+  if (j.contains("confirm_timeout_ms")) {
+    j.at("confirm_timeout_ms").get_to(c.confirm_timeout_ms);
+  }
+  if (j.contains("adapter_policy")) {
+    j.at("adapter_policy").get_to(c.adapter_policy);
+  }
+  if (j.contains("max_links")) {
+    j.at("max_links").get_to(c.max_links);
+  }
+  if (j.contains("stats_interval")) {
+    j.at("stats_interval").get_to(c.stats_interval);
+  }
+  if (j.contains("min_write_interval_ms")) {
+    j.at("min_write_interval_ms").get_to(c.min_write_interval_ms);
+  }
+  if (j.contains("max_in_flight")) {
+    j.at("max_in_flight").get_to(c.max_in_flight);
+  }
+  if (j.contains("command_deadline_ms")) {
+    j.at("command_deadline_ms").get_to(c.command_deadline_ms);
+  }
+  if (j.contains("heartbeat_interval")) {
+    j.at("heartbeat_interval").get_to(c.heartbeat_interval);
+  }
+  if (j.contains("status_interval_ms")) {
+    j.at("status_interval_ms").get_to(c.status_interval_ms);
+  }
+  if (j.contains("keepalive_interval_ms")) {
+    j.at("keepalive_interval_ms").get_to(c.keepalive_interval_ms);
+  }
+  if (j.contains("warmup_window_min")) {
+    j.at("warmup_window_min").get_to(c.warmup_window_min);
+  }
+  if (j.contains("warmup_min_weeks")) {
+    j.at("warmup_min_weeks").get_to(c.warmup_min_weeks);
+  }
+  if (j.contains("hedge_writes")) {
+    j.at("hedge_writes").get_to(c.hedge_writes);
+  }
+  if (j.contains("cache_file")) {
+    j.at("cache_file").get_to(c.cache_file);
+  }
 
   for (auto &light : j.at("hue_lights")) {
     c.hue_lights.emplace_back(light.at("name"), light.at("config_topic"),
                               light.at("availability_topic"),
                               light.at("set_topic"), light.at("status_topic"),
                               light.at("mac"));
+    if (light.contains("adapter")) {
+      light.at("adapter").get_to(c.hue_lights.back().adapter);
+    }
+    if (light.contains("priority")) {
+      light.at("priority").get_to(c.hue_lights.back().priority);
+    }
+    if (light.contains("status_interval_ms")) {
+      light.at("status_interval_ms")
+          .get_to(c.hue_lights.back().status_interval_ms);
+    }
+  }
+  if (j.contains("groups")) {
+    for (auto &group : j.at("groups")) {
+      c.groups.emplace_back(group.at("name"), group.at("set_topic"),
+                            group.at("members"));
+    }
+  }
+  if (j.contains("scenes")) {
+    for (auto &scene : j.at("scenes")) {
+      auto &s = c.scenes.emplace_back(scene.at("name"), scene.at("set_topic"));
+      for (auto &state : scene.at("states")) {
+        s.states.emplace_back(state.at("mac"), state);
+      }
+    }
   }
 }
 
 bool isDaemon = false, isTesting = false;
 
+// Commands from the MQTT thread to the BLE worker serving a light
+enum light_cmd_type {
+  // Merge `state` into the desired state of the light
+  LIGHT_CMD_STATE,
+  // Serve the light from this worker from now on
+  LIGHT_CMD_ADOPT,
+  // Like LIGHT_CMD_ADOPT, also connects the light and reads its state.
+  // `state` is the last known state, if any.
+  LIGHT_CMD_START,
+  // `state` is what the status topic of the light held at startup
+  LIGHT_CMD_RECOVER,
+  // Connect the light now, it is likely to be commanded soon
+  LIGHT_CMD_WARM,
+};
+
+struct light_cmd_s {
+  light_cmd_type type;
+  hue_device_handle *handle = nullptr;
+  LightState state{};
+  std::chrono::steady_clock::time_point deadline{};
+  // Group or scene command the state belongs to, or nullptr
+  group_op_s *group = nullptr;
+};
+
+// State events from the BLE workers to the MQTT thread
+enum light_event_type {
+  // The bulb reported `state`
+  LIGHT_EVENT_STATE,
+  // The light is online (value 1) or offline (value 0)
+  LIGHT_EVENT_AVAILABILITY,
+  // A member of `group` was written at `time`
+  LIGHT_EVENT_GROUP_WRITE,
+  // A member of `group` is done, `value` is 0 or an error
+  LIGHT_EVENT_GROUP_DONE,
+  // The light was moved to the adapter in its device path
+  LIGHT_EVENT_MOVED,
+  // A command reached a worker after the light moved away, `time` is the
+  // command deadline
+  LIGHT_EVENT_BOUNCE,
+  // Notifications of the light are set up, `value` is the MTU of its link
+  LIGHT_EVENT_MTU,
+  // The adapter of `worker` was power cycled, see BleManager::adapter_stats
+  LIGHT_EVENT_RECOVERED,
+};
+
+struct ble_worker_s;
+
+struct light_event_s {
+  light_event_type type;
+  hue_device_handle *handle = nullptr;
+  LightState state{};
+  std::chrono::steady_clock::time_point time{};
+  group_op_s *group = nullptr;
+  int value = 0;
+  ble_worker_s *worker = nullptr;
+};
+
+// Load of one thread. CPU time and ring depth are written by the thread
+// itself, ring_full by the producers of its input ring.
+struct thread_stats_s {
+  std::atomic<double> cpu_ms{0};
+  // Ring entries handled, and the most found waiting in one pass
+  std::atomic<unsigned long> handled{0};
+  std::atomic<unsigned long> ring_max{0};
+  // Times a producer found the input ring full
+  std::atomic<unsigned long> ring_full{0};
+
+  // Call from the owning thread after taking `count` ring entries
+  void update(unsigned long count) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    cpu_ms = ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+    handled += count;
+    if (count > ring_max) {
+      ring_max = count;
+    }
+  }
+
+  json to_json() {
+    return json{{"cpu_ms", cpu_ms.load()},
+                {"handled", handled.load()},
+                {"ring_max", ring_max.load()},
+                {"ring_full", ring_full.load()}};
+  }
+};
+
+// Serves the lights of one adapter on its own thread and D-Bus connection,
+// so a slow bluez call never stalls MQTT or the other adapters
+struct ble_worker_s {
+  std::string adapter;
+  std::thread thread;
+  // Runs the per light flows, polled by the worker thread
+  boost::asio::io_context io;
+  boost::lockfree::spsc_queue<light_cmd_s, boost::lockfree::capacity<256>>
+      commands;
+  // Only touched by the worker thread
+  std::vector<hue_device_handle *> lights;
+  BleScheduler scheduler;
+  thread_stats_s stats;
+  // The adapter is being power cycled, see ble_worker_recover()
+  bool recovering = false;
+  // Latency in ms of the last writes acknowledged by bluez, and of those
+  // confirmed by a notification or read-back, oldest first, and their p95
+  std::deque<double> writeLatency;
+  std::atomic<double> writeP95{0};
+  std::deque<double> confirmLatency;
+  std::atomic<double> confirmP95{0};
+  // Copy of the scheduler statistics for the MQTT thread
+  std::mutex lock;
+  BleScheduler::class_stats queue_wait[BLE_OP_CLASSES];
+};
+
+// Every worker feeds this ring, the MQTT thread drains it
+boost::lockfree::queue<light_event_s, boost::lockfree::capacity<1024>>
+    light_events;
+thread_stats_s mqtt_stats;
+// Only used by the MQTT thread
+LightCache light_cache;
+// Lights whose status topic still holds the state from the cache
+std::set<std::string> light_cache_stale;
+// Retained status payloads are taken as the state of their light while set.
+// status_recovered tells the main loop that every retained payload has been
+// queued, recovery ends once it has routed them.
+bool status_recovering = false;
+bool status_recovered = false;
+
+// Usage prediction, only used by the MQTT thread
+struct warmup_s {
+  // Device MAC -> hour since the epoch its last command was counted in
+  std::map<std::string, time_t> counted;
+  // Lights warmed up for the current window, and those commanded since
+  std::set<hue_device_handle *> warm;
+  std::set<hue_device_handle *> used;
+  std::chrono::steady_clock::time_point windowEnd;
+  // Lights warmed up, commands to warmed and to cold lights, and warmed
+  // lights nobody commanded within their window
+  unsigned long warmed = 0;
+  unsigned long hits = 0;
+  unsigned long misses = 0;
+  unsigned long unused = 0;
+} warmup;
+
+// Hand an event to the MQTT thread, waiting for room while the ring is full
+static void light_event(const light_event_s &event) {
+  while (!light_events.push(event)) {
+    mqtt_stats.ring_full++;
+    usleep(1000);
+  }
+}
+
+// Wait for the bulb to notify the written value before publishing it, the
+// worker falls back to a single read once the deadline passes
+static void light_expect(hue_device_handle *handle, int *expect, int level) {
+  *expect = level;
+  handle->expectDeadline =
+      std::chrono::steady_clock::now() +
+      std::chrono::milliseconds(config.confirm_timeout_ms);
+}
+
+// Latency reports of completed group/scene commands, published by main()
+std::queue<json> group_reports;
+
+// Record one member finishing a group command on the MQTT thread, reporting
+// the time from the first write to the last confirmation once every member
+// is done
+static void group_finish(group_op_s *op, int err) {
+  if (err != 0) {
+    op->failed++;
+  }
+  if (--op->outstanding > 0) {
+    return;
+  }
+  double ms = op->written ? std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - op->firstWrite)
+                                .count()
+                          : 0;
+  syslog(LOG_NOTICE, "group %s done in %.1f ms, %u/%u failed", op->name.c_str(),
+         ms, op->failed, op->members);
+  group_reports.push(json{{"group", op->name},
+                          {"members", op->members},
+                          {"failed", op->failed},
+                          {"latency_ms", ms}});
+  delete op;
+}
+
+// Report one member finishing a group command from a worker
+static void group_done(group_op_s *op, int err) {
+  light_event({.type = LIGHT_EVENT_GROUP_DONE, .group = op, .value = err});
+}
+
+struct command_stats_s {
+  std::atomic<unsigned long> received = 0;
+  // Merged into a newer command before being written
+  std::atomic<unsigned long> superseded = 0;
+  // Dropped because their deadline passed before they could be written
+  std::atomic<unsigned long> expired = 0;
+  // Completed without a write because the bulb already matched them
+  std::atomic<unsigned long> suppressed = 0;
+  // Writes that failed and were issued again
+  std::atomic<unsigned long> retried = 0;
+} command_stats;
+
+// Link supervision over every worker
+struct link_stats_s {
+  // Command writes that found their link up, and those that connected first
+  std::atomic<unsigned long> command_hits = 0;
+  std::atomic<unsigned long> command_misses = 0;
+  // Links the bulbs dropped, keep-alive reads sent, and links reconnected
+  // ahead of a predicted drop
+  std::atomic<unsigned long> drops = 0;
+  std::atomic<unsigned long> keepalives = 0;
+  std::atomic<unsigned long> cycled = 0;
+} link_stats;
+
+// Hedged writes over every worker
+struct hedge_stats_s {
+  // Hedges sent, hedges confirmed before their original write, and lights
+  // that followed their link to the adapter of a hedge
+  std::atomic<unsigned long> fired = 0;
+  std::atomic<unsigned long> won = 0;
+  std::atomic<unsigned long> moved = 0;
+} hedge_stats;
+
+// When a command has to be written by, counted from its arrival
+static std::chrono::steady_clock::time_point
+command_deadline(const Mqtt::Publish &msg) {
+  if (msg.message_expiry > 0) {
+    return msg.arrival + std::chrono::seconds(msg.message_expiry);
+  }
+  return msg.arrival + std::chrono::milliseconds(config.command_deadline_ms);
+}
+
+// Drop the desired state of a bulb, failing any group commands waiting on it
+static void light_desired_drop(hue_device_handle *handle) {
+  handle->desired = {};
+  for (auto &op : handle->pendingGroups) {
+    group_done(op, -1);
+  }
+  handle->pendingGroups.clear();
+}
+
+static bool light_has(const LightState &state) {
+  return state.power || state.brightness || state.mireds || state.transition;
+}
+
+// Fields of the desired state that the bulb has not reported yet
+static LightState light_delta(hue_device_handle *handle) {
+  // A recovered state may be wrong, nothing counts as applied until read
+  const LightState unknown;
+  auto &d = handle->desired;
+  auto &r = handle->stale ? unknown : handle->reported;
+  LightState delta;
+
+  if (d.power && d.power != r.power) {
+    delta.power = d.power;
+  }
+  if (d.brightness && d.brightness != r.brightness) {
+    delta.brightness = d.brightness;
+  }
+  if (d.mireds && d.mireds != r.mireds) {
+    delta.mireds = d.mireds;
+  }
+  if (delta.power || delta.brightness || delta.mireds) {
+    delta.transition = d.transition;
+  }
+  return delta;
+}
+
+// Record state reported by the bulb. The status is only republished when a
+// field actually changed, and desired fields the bulb now matches are done.
+static void light_report(hue_device_handle *handle, const LightState &state) {
+  auto &r = handle->reported;
+  auto &d = handle->desired;
+
+  handle->link.traffic(std::chrono::steady_clock::now());
+  if (state.power) {
+    handle->nextAvailable |= r.power != state.power;
+    r.power = state.power;
+    if (d.power == r.power) {
+      d.power.reset();
+    }
+    if (handle->expectPower == *r.power) {
+      handle->expectPower = -1;
+    }
+  }
+  if (state.brightness) {
+    handle->nextAvailable |= r.brightness != state.brightness;
+    r.brightness = state.brightness;
+    if (d.brightness == r.brightness) {
+      d.brightness.reset();
+    }
+    if (handle->expectBrightness == *r.brightness) {
+      handle->expectBrightness = -1;
+    }
+  }
+  if (state.mireds) {
+    handle->nextAvailable |= r.mireds != state.mireds;
+    r.mireds = state.mireds;
+    if (d.mireds == r.mireds) {
+      d.mireds.reset();
+    }
+  }
+  if (!d.power && !d.brightness && !d.mireds) {
+    d.transition.reset();
+  }
+}
+
+// The link of a light came up
+static void light_link_up(hue_device_handle *handle) {
+  handle->link.up(std::chrono::steady_clock::now());
+  handle->notifyRetry = {};
+  handle->notifyBackoff = {};
+}
+
+// Bluez reported the link down. Returns true when the bulb dropped a held
+// link, not when it is the disconnect of a link cycled on purpose.
+static bool light_link_dropped(hue_device_handle *handle, bool held) {
+  if (!handle->link.dropped(std::chrono::steady_clock::now(), held,
+                            config.keepalive_interval_ms)) {
+    return false;
+  }
+  link_stats.drops++;
+  return true;
+}
+
+// Add the latency of one write since `start` to a window of the last 200
+static void light_latency(std::deque<double> &samples, std::atomic<double> &p95,
+                          std::chrono::steady_clock::time_point start) {
+  samples.push_back(std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count());
+  if (samples.size() > 200) {
+    samples.pop_front();
+  }
+  std::vector<double> sorted(samples.begin(), samples.end());
+  auto it = sorted.begin() + sorted.size() * 95 / 100;
+  std::nth_element(sorted.begin(), it, sorted.end());
+  p95 = *it;
+}
+
+// The race is decided, light_flush() may write the light again
+static void light_settle(hue_device_handle *handle,
+                         std::shared_ptr<write_race_s> race) {
+  race->settled = true;
+  handle->writesInFlight--;
+  if (handle->race == race) {
+    handle->race.reset();
+  }
+}
+
+// One side of a write race finished. A write the bulb confirms by
+// notification stays open until light_confirm(), the first confirmed side
+// settles the race; it only fails once every side has.
+static void light_write_done(ble_worker_s *worker, hue_device_handle *handle,
+                             std::shared_ptr<write_race_s> race, int err,
+                             bool hedge) {
+  race->outstanding--;
+  if (hedge) {
+    handle->hedgesInFlight--;
+  } else if (err == 0) {
+    // Slow acknowledgements count even when a hedge beat them, the p95 must
+    // see them. Socket writes complete before reaching the bulb, only their
+    // confirmation is timed.
+    light_latency(worker->writeLatency, worker->writeP95, race->start);
+  }
+  if (race->settled || (err < 0 && race->outstanding > 0)) {
+    return;
+  }
+  auto &state = race->state;
+  auto &groups = race->groups;
+  if (err < 0) {
+    light_settle(handle, race);
+    syslog(LOG_NOTICE, "write to %s failed", handle->device->mac.c_str());
+    command_stats.retried++;
+    handle->pendingGroups.insert(handle->pendingGroups.end(), groups.begin(),
+                                 groups.end());
+    return;
+  }
+  if (hedge) {
+    hedge_stats.won++;
+  }
+  // Only power and brightness are notified by the bulb, and only on the
+  // link of its own adapter. Socket writes are not acknowledged at all, their
+  // values wait for a notification or the read after the deadline.
+  const bool unacked = err == GATT_WRITE_UNACKED;
+  const bool notify = config.confirm == "notify" && !hedge;
+  LightState confirmed;
+  confirmed.mireds = state.mireds;
+  if (state.power &&
+      (unacked || (notify && handle->device->light_power_fd > 0))) {
+    light_expect(handle, &handle->expectPower, *state.power);
+  } else {
+    confirmed.power = state.power;
+  }
+  if (state.brightness &&
+      (unacked || (notify && handle->device->light_brightness_fd > 0))) {
+    light_expect(handle, &handle->expectBrightness, *state.brightness);
+  } else {
+    confirmed.brightness = state.brightness;
+  }
+  light_report(handle, confirmed);
+  if (handle->desired.transition == state.transition) {
+    handle->desired.transition.reset();
+  }
+  if (handle->expectPower >= 0 || handle->expectBrightness >= 0) {
+    // Group members are done once confirmed as well
+    race->confirming = true;
+    race->outstanding++;
+    return;
+  }
+  for (auto &op : groups) {
+    group_done(op, 0);
+  }
+  light_settle(handle, race);
+}
+
+// Settle a write once the bulb has notified or been read back with every
+// value it was sent. The read-back after the deadline settles it either way:
+// a value the bulb did not take fails the group commands of the write and
+// stays desired for light_flush() to write again.
+static void light_confirm(ble_worker_s *worker, hue_device_handle *handle,
+                          bool readBack = false) {
+  auto race = handle->race;
+  const bool confirmed =
+      handle->expectPower < 0 && handle->expectBrightness < 0;
+
+  if (readBack) {
+    handle->expectPower = -1;
+    handle->expectBrightness = -1;
+  }
+  if (race == nullptr || !race->confirming || (!confirmed && !readBack)) {
+    return;
+  }
+  race->outstanding--;
+  if (confirmed) {
+    light_latency(worker->confirmLatency, worker->confirmP95, race->start);
+  }
+  for (auto &op : race->groups) {
+    group_done(op, confirmed ? 0 : -1);
+  }
+  light_settle(handle, race);
+}
+
+// Write the fields in one operation. Written values become reported once
+// confirmed; a failed write is left in the desired state for the reconciler
+// to retry until the command deadline.
+static void light_apply(ble_worker_s *worker, hue_device_handle *handle,
+                        LightState state, std::vector<group_op_s *> groups,
+                        ble_op_done done) {
+  auto race = std::make_shared<write_race_s>();
+
+  handle->writesInFlight++;
+  handle->lastWrite = std::chrono::steady_clock::now();
+  handle->link.traffic(handle->lastWrite);
+  for (auto &op : groups) {
+    light_event({.type = LIGHT_EVENT_GROUP_WRITE,
+                 .time = handle->lastWrite,
+                 .group = op});
+  }
+  race->state = state;
+  race->groups = groups;
+  race->start = handle->lastWrite;
+  handle->race = race;
+  handle->device->apply(state, [=](int err) {
+    done();
+    light_write_done(worker, handle, race, err, false);
+  });
+}
+
+// Send a write that is taking longer than the p95 of its adapter again
+// through another adapter that has seen the bulb. A bulb keeps a single link,
+// so its link here is dropped for the other adapter to connect; the write
+// already sent may still be confirmed first. Either way the light then moves
+// to the adapter holding its link.
+static void light_hedge(ble_worker_s *worker, hue_device_handle *handle) {
+  auto race = handle->race;
+
+  if (!config.hedge_writes || race == nullptr || race->hedged ||
+      handle->hedgesInFlight > 0) {
+    return;
+  }
+  // A write waiting for its confirmation is measured against confirmations
+  auto &samples =
+      race->confirming ? worker->confirmLatency : worker->writeLatency;
+  double p95 = race->confirming ? worker->confirmP95 : worker->writeP95;
+  if (samples.size() < 20 ||
+      std::chrono::steady_clock::now() - race->start <
+          std::chrono::duration<double, std::milli>(p95)) {
+    return;
+  }
+  race->hedged = true;
+  std::string adapter;
+  for (auto &a : bleManager.adapter_list()) {
+    if (a != handle->device->adapterPath && bleManager.adapter_ok(a) &&
+        bleManager.adapter_reaches(a, handle->device->mac)) {
+      adapter = a;
+      break;
+    }
+  }
+  if (adapter.empty()) {
+    return;
+  }
+  syslog(LOG_DEBUG, "write to %s is slow, hedging through %s",
+         handle->device->mac.c_str(), adapter.c_str());
+  hedge_stats.fired++;
+  race->outstanding++;
+  handle->hedgesInFlight++;
+  race->hedge = std::make_unique<HueDevice>(handle->device->mac, adapter);
+  // The hedge has no notification sockets, its writes must be acknowledged
+  race->hedge->gatt_write_fast = false;
+  // Out of the pool first, so the Connected signal is not taken for a drop
+  bleManager.link_release(handle->device);
+  handle->device->device_disconnect_async([=](int) {
+    auto hedge = race->hedge.get();
+    hedge->device_connect_async([=](int err) {
+      if (err == 0) {
+        handle->moveTo = adapter;
+      }
+      if (err != 0 || race->settled) {
+        light_write_done(worker, handle, race, err, true);
+        return;
+      }
+      hedge->apply(race->state, [=](int err) {
+        light_write_done(worker, handle, race, err, true);
+      });
+    });
+  });
+}
+
+// Parse a command from home assistant/node red on the MQTT thread
+static LightState light_parse(const std::string &message) {
+  int brightness = 0;
+  std::string state = "UNK";
+  LightState parsed;
+
+  if (message.starts_with("{")) {
+    // Handle JSON requests
+    auto req = json::parse(message);
+    if (req.contains("state")) {
+      req.at("state").get_to(state);
+    }
+    if (req.contains("brightness")) {
+      req.at("brightness").get_to(brightness);
+    }
+    if (req.contains("color_temp")) {
+      parsed.mireds = req.at("color_temp").get<uint16_t>();
+    }
+    if (req.contains("transition")) {
+      // Seconds from home assistant, 100 ms steps for the bulb
+      parsed.transition = (uint16_t)(req.at("transition").get<double>() * 10);
+    }
+  } else if (message == "OFF" || message == "ON") {
+    // Handle simple ON/OFF requests
+    state = message;
+  }
+  if (state == "ON" || state == "OFF") {
+    parsed.power = state == "ON";
+  }
+  if (brightness > 0) {
+    parsed.brightness = brightness;
+  }
+  return parsed;
+}
+
+// Merge a parsed command into the desired state of the bulb, later commands
+// overwrite earlier ones field by field
+static void light_command(hue_device_handle *handle, const LightState &state,
+                          std::chrono::steady_clock::time_point deadline) {
+  auto &d = handle->desired;
+
+  command_stats.received++;
+  if (light_has(d)) {
+    // Stale fields must not be merged into a fresh command
+    if (std::chrono::steady_clock::now() > handle->desiredDeadline) {
+      command_stats.expired++;
+      light_desired_drop(handle);
+    } else {
+      command_stats.superseded++;
+    }
+  }
+  handle->desiredDeadline = deadline;
+
+  if (state.power) {
+    d.power = state.power;
+  }
+  if (state.brightness) {
+    d.brightness = state.brightness;
+  }
+  if (state.mireds) {
+    d.mireds = state.mireds;
+  }
+  if (state.transition) {
+    d.transition = state.transition;
+  }
+}
+
+// Reconcile the desired state of a bulb with what it reported. Commands the
+// bulb already matches complete without any BLE traffic; otherwise the
+// differing fields are queued once previous writes are confirmed and the
+// minimum write interval has passed. The delta is taken when the scheduler
+// runs the write, so commands arriving while it waits are coalesced into it.
+static void light_flush(ble_worker_s *worker, hue_device_handle *handle) {
+  if (!light_has(handle->desired) && handle->pendingGroups.empty()) {
+    return;
+  }
+  if (handle->starting || handle->writeQueued || handle->writesInFlight > 0 ||
+      handle->expectPower >= 0 || handle->expectBrightness >= 0 ||
+      handle->hedgesInFlight > 0 || !handle->moveTo.empty() ||
+      worker->recovering) {
+    return;
+  }
+  if (std::chrono::steady_clock::now() > handle->desiredDeadline) {
+    syslog(LOG_NOTICE, "command for %s expired, dropping it",
+           handle->device->mac.c_str());
+    command_stats.expired++;
+    light_desired_drop(handle);
+    return;
+  }
+  if (!light_has(light_delta(handle))) {
+    command_stats.suppressed += light_has(handle->desired);
+    handle->desired = {};
+    for (auto &op : handle->pendingGroups) {
+      group_done(op, 0);
+    }
+    handle->pendingGroups.clear();
+    return;
+  }
+  if (std::chrono::steady_clock::now() - handle->lastWrite <
+          std::chrono::milliseconds(config.min_write_interval_ms) ||
+      std::chrono::steady_clock::now() < handle->writeRetry) {
+    return;
+  }
+  handle->writeQueued = true;
+  auto write = [worker, handle](ble_op_done done) {
+    auto pending = [handle]() {
+      return light_has(light_delta(handle)) &&
+             std::chrono::steady_clock::now() <= handle->desiredDeadline;
+    };
+    if (!pending()) {
+      // light_flush() completes or expires it on the next pass
+      handle->writeQueued = false;
+      done();
+      return;
+    }
+    const bool held = bleManager.link_held(handle->device);
+    bleManager.link_acquire_async(handle->device, [=](int err) {
+      handle->writeQueued = false;
+      if (err != 0) {
+        // Keep the command, light_flush() retries it until it expires
+        syslog(LOG_NOTICE, "%s is unavailable, retrying command",
+               handle->device->mac.c_str());
+        link_stats.command_misses++;
+        handle->writeRetry =
+            std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        done();
+        return;
+      }
+      if (held) {
+        link_stats.command_hits++;
+      } else {
+        link_stats.command_misses++;
+        light_link_up(handle);
+      }
+      // The command may have changed or expired while connecting
+      if (!pending()) {
+        done();
+        return;
+      }
+      auto delta = light_delta(handle);
+      // Colour temperature needs the combined control characteristic, a bulb
+      // without one keeps its current white
+      if (delta.mireds && handle->device->light_control_path().empty()) {
+        syslog(LOG_NOTICE, "%s has no colour temperature, ignoring it",
+               handle->device->mac.c_str());
+        handle->desired.mireds.reset();
+        delta.mireds.reset();
+      }
+      // Set power, brightness and colour temperature in one operation
+      auto groups = std::move(handle->pendingGroups);
+      handle->pendingGroups.clear();
+      light_apply(worker, handle, delta, groups, done);
+    });
+  };
+  worker->scheduler.submit(handle->device, BLE_OP_COMMAND, write);
+}
+
+// Nothing of the light is queued or in flight on its worker, so it can be
+// handed to another one
+static bool light_idle(hue_device_handle *handle) {
+  return handle->writesInFlight == 0 && handle->hedgesInFlight == 0 &&
+         !handle->writeQueued && !handle->notifyPending &&
+         !handle->readQueued && !handle->connectQueued && !handle->starting;
+}
+
+// Take a state published before the bulb was read, it stands in for the
+// reported state until the bulb is read
+static void light_recover(hue_device_handle *handle, const LightState &state) {
+  if (!state.power || (light_has(handle->reported) && !handle->stale)) {
+    return;
+  }
+  handle->reported.power = state.power;
+  if (state.brightness) {
+    handle->reported.brightness = state.brightness;
+  }
+  if (state.mireds) {
+    handle->reported.mireds = state.mireds;
+  }
+  handle->stale = true;
+}
+
+// Read power and/or brightness without blocking, `done` gets -1 for a field
+// that was not asked for or could not be read
+static void light_read(HueDevice *device, bool power, bool brightness,
+                       std::function<void(int power, int brightness)> done) {
+  auto next = [device, brightness, done](int power) {
+    if (!brightness) {
+      done(power, -1);
+      return;
+    }
+    device->gatt_read_char_async(
+        device->light_brightness_path(),
+        [done, power](int brightness) { done(power, brightness); });
+  };
+  if (!power) {
+    next(-1);
+    return;
+  }
+  device->gatt_read_char_async(device->light_power_path(), next);
+}
+
+// Read the state of a light in the background. The state is published
+// even when it did not change, replacing a recovered one.
+static void light_refresh(ble_worker_s *worker, hue_device_handle *handle) {
+  if (handle->readQueued) {
+    return;
+  }
+  handle->readQueued = true;
+  worker->scheduler.submit(
+      handle->device, BLE_OP_READ, [handle](ble_op_done done) {
+        light_read(handle->device, true, true,
+                   [handle, done](int power, int brightness) {
+                     LightState state;
+                     handle->readQueued = false;
+                     if (power >= 0) {
+                       state.power = power;
+                     }
+                     if (brightness >= 0) {
+                       state.brightness = brightness;
+                     }
+                     handle->stale = power < 0 || brightness < 0;
+                     handle->nextAvailable = 1;
+                     light_report(handle, state);
+                     done();
+                   });
+      });
+}
+
+// Connect a light when its worker starts serving it, subscribe to its
+// notifications and report its availability and current state, unless a
+// recovered state stands in for it. Runs as a coroutine on the worker
+// io_context so every light of the adapter comes up at the same time.
+// Acquire the notification sockets the bulb lacks. Buffers keep the size
+// from the cache when bluez reports no MTU.
+static awaitable<void> light_notify_acquire(hue_device_handle *handle) {
+  auto bleDevice = handle->device;
+
+  handle->notifyPending = true;
+  if (bleDevice->light_power_fd == 0) {
+    auto [fd, mtu] = co_await bleDevice->async_acquire_notify(
+        bleDevice->light_power_path(), use_awaitable);
+    bleDevice->light_power_fd = fd;
+    if (mtu > 0 || bleDevice->light_power_buf.empty()) {
+      bleDevice->light_power_buf.resize(mtu > 0 ? mtu : 512);
+    }
+    if (mtu > 0) {
+      light_event({.type = LIGHT_EVENT_MTU, .handle = handle, .value = mtu});
+    }
+  }
+  if (bleDevice->light_brightness_fd == 0) {
+    auto [fd, mtu] = co_await bleDevice->async_acquire_notify(
+        bleDevice->light_brightness_path(), use_awaitable);
+    bleDevice->light_brightness_fd = fd;
+    if (mtu > 0 || bleDevice->light_brightness_buf.empty()) {
+      bleDevice->light_brightness_buf.resize(mtu > 0 ? mtu : 512);
+    }
+  }
+  handle->notifyPending = false;
+  if (bleDevice->light_power_fd == 0 || bleDevice->light_brightness_fd == 0) {
+    handle->notifyBackoff = std::clamp(handle->notifyBackoff * 2,
+                                       std::chrono::milliseconds(1000),
+                                       std::chrono::milliseconds(60000));
+    handle->notifyRetry =
+        std::chrono::steady_clock::now() + handle->notifyBackoff;
+  }
+}
+
+static awaitable<void> light_start(ble_worker_s *worker,
+                                   hue_device_handle *handle) {
+  auto bleDevice = handle->device;
+  boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+
+  handle->starting = true;
+  // Wait for device to connect
+  while (co_await bleDevice->async_connect(use_awaitable) < 0) {
+    syslog(LOG_NOTICE, "waiting for %s to connect...",
+           bleDevice->devicePath.c_str());
+    timer.expires_after(std::chrono::seconds(1));
+    co_await timer.async_wait(use_awaitable);
+  }
+  // Characteristics can only be used once bluez has resolved the services
+  for (int i = 0; i < 50; i++) {
+    if (co_await bleDevice->async_property("ServicesResolved",
+                                           use_awaitable) == 1) {
+      break;
+    }
+    timer.expires_after(std::chrono::milliseconds(100));
+    co_await timer.async_wait(use_awaitable);
+  }
+  // Already connected, this only takes the device into the pool
+  bleManager.link_acquire(bleDevice);
+  light_link_up(handle);
+  syslog(LOG_DEBUG, "publish availability for %s",
+         bleDevice->devicePath.c_str());
+  light_event({.type = LIGHT_EVENT_AVAILABILITY,
+               .handle = handle,
+               .value = bleManager.link_held(bleDevice)});
+  co_await light_notify_acquire(handle);
+
+  // A recovered state is already published, the bulb is read once nothing
+  // more urgent is queued
+  if (handle->stale) {
+    light_refresh(worker, handle);
+    handle->starting = false;
+    co_return;
+  }
+
+  // Publish the current state of the light
+  LightState state;
+  int power =
+      co_await bleDevice->async_read(bleDevice->light_power_path(), use_awaitable);
+  int brightness = co_await bleDevice->async_read(
+      bleDevice->light_brightness_path(), use_awaitable);
+  if (power >= 0) {
+    state.power = power;
+  }
+  if (brightness >= 0) {
+    state.brightness = brightness;
+  }
+  handle->nextAvailable = 1;
+  handle->stale = false;
+  light_report(handle, state);
+  handle->starting = false;
+}
+
+// Queue a connection attempt unless one is waiting already. A hedge may be
+// moving the link to another adapter, which must not be fought over.
+static void light_reconnect(ble_worker_s *worker, hue_device_handle *handle) {
+  if (handle->connectQueued || handle->hedgesInFlight > 0 ||
+      !handle->moveTo.empty()) {
+    return;
+  }
+  handle->connectQueued = true;
+  worker->scheduler.submit(
+      handle->device, BLE_OP_CONNECT, [handle](ble_op_done done) {
+        bleManager.link_acquire_async(handle->device, [handle, done](int err) {
+          handle->connectQueued = false;
+          if (err == 0) {
+            light_link_up(handle);
+          }
+          done();
+        });
+      });
+}
+
+// Keep the link of an idle light up: read a characteristic once it has been
+// quiet for the keep-alive interval, or half the shortest idle time the
+// bulb dropped a link after. Bulbs that drop links at a fixed age whatever
+// the traffic are reconnected shortly before that age instead, while no
+// command needs them.
+static void light_supervise(ble_worker_s *worker, hue_device_handle *handle) {
+  auto bleDevice = handle->device;
+  auto now = std::chrono::steady_clock::now();
+
+  if (config.keepalive_interval_ms <= 0 || !light_idle(handle) ||
+      !bleManager.link_held(bleDevice)) {
+    return;
+  }
+  auto &link = handle->link;
+  if (link.dropAge.size() >= 2) {
+    double age = *min_element(link.dropAge.begin(), link.dropAge.end());
+    if (now - link.linkUp > std::chrono::duration<double>(age * 0.9)) {
+      syslog(LOG_NOTICE, "%s drops links after %.0f s, reconnecting early",
+             bleDevice->mac.c_str(), age);
+      handle->connectQueued = true;
+      worker->scheduler.submit(
+          bleDevice, BLE_OP_CONNECT, [handle](ble_op_done done) {
+            auto bleDevice = handle->device;
+            // The cycle ends with its disconnect, which bluez may report
+            // after the new link is up
+            handle->link.cycle(std::chrono::steady_clock::now());
+            bleManager.link_release(bleDevice);
+            bleDevice->device_disconnect_async([handle, done](int) {
+              bleManager.link_acquire_async(
+                  handle->device, [handle, done](int err) {
+                    handle->connectQueued = false;
+                    if (err == 0) {
+                      light_link_up(handle);
+                    }
+                    link_stats.cycled++;
+                    done();
+                  });
+            });
+          });
+      return;
+    }
+  }
+  auto interval = std::chrono::duration<double, std::milli>(
+      config.keepalive_interval_ms);
+  if (!link.dropIdle.empty()) {
+    double idle = *min_element(link.dropIdle.begin(), link.dropIdle.end());
+    interval = std::min(interval, std::chrono::duration<double, std::milli>(
+                                      idle * 500));
+  }
+  if (now - link.lastTraffic < interval) {
+    return;
+  }
+  handle->readQueued = true;
+  link_stats.keepalives++;
+  worker->scheduler.submit(
+      bleDevice, BLE_OP_READ, [handle](ble_op_done done) {
+        auto bleDevice = handle->device;
+        bleDevice->gatt_read_char_async(
+            bleDevice->light_power_path(), [handle, done](int power) {
+              handle->readQueued = false;
+              if (power >= 0) {
+                light_report(handle, {.power = (uint8_t)power});
+              }
+              done();
+            });
+      });
+}
+
+// Ask bluez for the signals about this light only: its characteristics
+// coming and going, and its link dropping
+static void light_watch(ble_worker_s *worker, hue_device_handle *handle) {
+  auto bleDevice = handle->device;
+
+  bleManager.objects_watch(bleDevice->devicePath, true);
+  bleManager.signal_watch(
+      bleDevice->devicePath, "org.bluez.Device1",
+      [worker, handle](DBusMessage *msg) {
+        auto bleDevice = handle->device;
+        if (BleManager::property_bool(msg, "Connected") != 0 ||
+            !light_link_dropped(handle, bleManager.link_held(bleDevice))) {
+          return;
+        }
+        syslog(LOG_NOTICE, "%s is disconnected, reconnecting...",
+               bleDevice->devicePath.c_str());
+        bleManager.link_release(bleDevice);
+        light_reconnect(worker, handle);
+      });
+}
+
+static void light_unwatch(hue_device_handle *handle) {
+  auto bleDevice = handle->device;
+
+  bleManager.objects_watch(bleDevice->devicePath, true, false);
+  bleManager.signal_unwatch(bleDevice->devicePath, "org.bluez.Device1");
+}
+
+static void ble_worker_command(ble_worker_s *worker, const light_cmd_s &cmd) {
+  auto &lights = worker->lights;
+  auto handle = cmd.handle;
+
+  if (cmd.type == LIGHT_CMD_ADOPT || cmd.type == LIGHT_CMD_START) {
+    lights.push_back(handle);
+    light_watch(worker, handle);
+    if (cmd.type == LIGHT_CMD_START) {
+      light_recover(handle, cmd.state);
+      boost::asio::co_spawn(worker->io, light_start(worker, handle),
+                            boost::asio::detached);
+    }
+    return;
+  }
+  if (find(lights.begin(), lights.end(), handle) == lights.end()) {
+    // A recovered state is of no use once the light has been read and
+    // moved, the new worker connects it anyway
+    if (cmd.type == LIGHT_CMD_RECOVER || cmd.type == LIGHT_CMD_WARM) {
+      return;
+    }
+    light_event({.type = LIGHT_EVENT_BOUNCE,
+                 .handle = handle,
+                 .state = cmd.state,
+                 .time = cmd.deadline,
+                 .group = cmd.group});
+    return;
+  }
+  if (cmd.type == LIGHT_CMD_RECOVER) {
+    light_recover(handle, cmd.state);
+    return;
+  }
+  if (cmd.type == LIGHT_CMD_WARM) {
+    if (!handle->starting && !bleManager.link_held(handle->device)) {
+      light_reconnect(worker, handle);
+    }
+    return;
+  }
+  light_command(handle, cmd.state, cmd.deadline);
+  if (cmd.group != nullptr) {
+    handle->pendingGroups.push_back(cmd.group);
+    // Members are not held back by the minimum write interval
+    handle->lastWrite = {};
+  }
+}
+
+// Power cycle an adapter bluez stopped answering for and bring back the
+// links it had. The lights restart in parallel, the recovery ends when the
+// last of them is back or after a minute.
+static awaitable<void> ble_worker_recover(ble_worker_s *worker) {
+  auto executor = co_await boost::asio::this_coro::executor;
+  boost::asio::steady_timer timer(executor);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<hue_device_handle *> restore;
+
+  syslog(LOG_ERR, "%s is not answering, power cycling it",
+         worker->adapter.c_str());
+  worker->recovering = true;
+  for (auto &handle : worker->lights) {
+    if (bleManager.link_held(handle->device)) {
+      // Also closes the notification sockets
+      bleManager.link_release(handle->device);
+      restore.push_back(handle);
+    }
+  }
+  bleManager.ble_power_set(worker->adapter, 0);
+  bleManager.ble_power_set(worker->adapter, 1);
+  for (int i = 0; i < 100 && !bleManager.ble_power_check(worker->adapter);
+       i++) {
+    timer.expires_after(std::chrono::milliseconds(100));
+    co_await timer.async_wait(use_awaitable);
+  }
+
+  auto remaining = std::make_shared<size_t>(restore.size());
+  for (auto &handle : restore) {
+    boost::asio::co_spawn(executor, light_start(worker, handle),
+                          [remaining](std::exception_ptr) { (*remaining)--; });
+  }
+  while (*remaining > 0 &&
+         std::chrono::steady_clock::now() - start < std::chrono::minutes(1)) {
+    timer.expires_after(std::chrono::milliseconds(100));
+    co_await timer.async_wait(use_awaitable);
+  }
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  syslog(LOG_NOTICE, "%s recovered in %.0f ms, %zu of %zu links restored",
+         worker->adapter.c_str(), ms, restore.size() - *remaining,
+         restore.size());
+  bleManager.adapter_recovered(worker->adapter, ms, restore.size(),
+                               restore.size() - *remaining);
+  worker->recovering = false;
+  light_event({.type = LIGHT_EVENT_RECOVERED, .worker = worker});
+}
+
+// Serve a light from another adapter: the one a hedge moved its link to, or
+// a healthy one when its own failed. Returns true once the light has left
+// this worker, the MQTT thread hands it to the new one.
+static bool light_move(ble_worker_s *worker, hue_device_handle *handle) {
+  auto bleDevice = handle->device;
+  std::string adapter;
+
+  if (!handle->moveTo.empty()) {
+    auto &moveTo = handle->moveTo;
+    adapter = bleManager.adapter_assign(
+        bleDevice->mac, "static", moveTo.substr(moveTo.rfind('/') + 1));
+    syslog(LOG_NOTICE, "a hedged write moved the link of %s, moving it to %s",
+           bleDevice->mac.c_str(), adapter.c_str());
+    hedge_stats.moved++;
+    moveTo.clear();
+  } else {
+    auto search =
+        find_if(config.hue_lights.begin(), config.hue_lights.end(),
+                [&bleDevice](struct hue_config_s &light) {
+                  return light.mac == bleDevice->mac;
+                });
+    adapter = bleManager.adapter_assign(
+        bleDevice->mac, config.adapter_policy,
+        search != config.hue_lights.end() ? search->adapter : "",
+        bleDevice->adapterPath);
+    syslog(LOG_NOTICE, "%s failed, moving %s to %s",
+           bleDevice->adapterPath.c_str(), bleDevice->mac.c_str(),
+           adapter.c_str());
+  }
+  bleManager.link_release(bleDevice);
+  light_unwatch(handle);
+  bleDevice->adapter_set(adapter);
+  if (adapter != worker->adapter) {
+    light_event({.type = LIGHT_EVENT_MOVED, .handle = handle});
+    return true;
+  }
+  light_watch(worker, handle);
+  return false;
+}
+
+// Power check of the adapter and the connection of every light it serves.
+// Lights on a failed adapter are reassigned and handed back to the MQTT
+// thread once nothing of theirs is in flight here.
+static void ble_worker_check(ble_worker_s *worker) {
+  auto &lights = worker->lights;
+
+  if (worker->recovering) {
+    return;
+  }
+  if (bleManager.adapter_failing(worker->adapter)) {
+    boost::asio::co_spawn(worker->io, ble_worker_recover(worker),
+                          boost::asio::detached);
+    return;
+  }
+  bleManager.ble_power_check(worker->adapter);
+  for (auto it = lights.begin(); it != lights.end();) {
+    auto handle = *it;
+    auto &bleDevice = handle->device;
+    if (handle->starting) {
+      it++;
+      continue;
+    }
+    // Move bulbs off adapters that stopped responding
+    if (!bleManager.adapter_ok(bleDevice->adapterPath) && light_idle(handle) &&
+        light_move(worker, handle)) {
+      it = lights.erase(it);
+      continue;
+    }
+    // Dropped links are normally reported by the Connected signal, this
+    // catches any that were missed. Evicted bulbs stay disconnected until a
+    // command needs them.
+    bool held = bleManager.link_held(bleDevice);
+    if (held && !bleDevice->device_connected_get() &&
+        light_link_dropped(handle, held)) {
+      syslog(LOG_NOTICE, "%s is disconnected, reconnecting...",
+             bleDevice->devicePath.c_str());
+      bleManager.link_release(bleDevice);
+    }
+    if (!bleManager.link_held(bleDevice) && (held || config.max_links == 0)) {
+      light_reconnect(worker, handle);
+    }
+    it++;
+  }
+}
+
+static void ble_worker_run(ble_worker_s *worker) {
+  auto &lights = worker->lights;
+  auto lastCheck = std::chrono::steady_clock::now();
+
+  auto work = boost::asio::make_work_guard(worker->io);
+
+  syslog(LOG_NOTICE, "BLE worker for %s started", worker->adapter.c_str());
+  // Notice the adapter going away
+  bleManager.objects_watch(worker->adapter, false);
+  while (true) {
+    // Pick up characteristics resolved since the last iteration and resume
+    // the flows whose D-Bus replies arrived
+    bleManager.process();
+    worker->io.poll();
+
+    // Take commands from the MQTT thread
+    light_cmd_s cmd;
+    unsigned long count = 0;
+    while (worker->commands.pop(cmd)) {
+      ble_worker_command(worker, cmd);
+      count++;
+    }
+
+    // Receive BLE notifications
+    for (auto &handle : lights) {
+      auto &bleDevice = handle->device;
+      if (handle->starting || !bleManager.link_held(bleDevice)) {
+        continue;
+      }
+      // Sockets are acquired once per link, the loop only reads them
+      if ((bleDevice->light_power_fd == 0 ||
+           bleDevice->light_brightness_fd == 0) &&
+          !handle->notifyPending &&
+          std::chrono::steady_clock::now() >= handle->notifyRetry) {
+        boost::asio::co_spawn(worker->io, light_notify_acquire(handle),
+                              boost::asio::detached);
+      }
+      const int power_fd = bleDevice->light_power_fd;
+      const int brightness_fd = bleDevice->light_brightness_fd;
+      if (power_fd > 0) {
+        const int s = bleDevice->gatt_notify_drain(
+            power_fd, bleDevice->light_power_buf,
+            [&handle](const uint8_t *value, int) {
+              light_report(handle, {.power = value[0]});
+            });
+        if (s < 0) {
+          bleDevice->light_notify_release();
+        }
+      }
+      if (brightness_fd > 0) {
+        const int s = bleDevice->gatt_notify_drain(
+            brightness_fd, bleDevice->light_brightness_buf,
+            [&handle](const uint8_t *value, int) {
+              light_report(handle, {.brightness = value[0]});
+            });
+        if (s < 0) {
+          bleDevice->light_notify_release();
+        }
+      }
+      light_confirm(worker, handle);
+      // No notification arrived in time, read the value once instead
+      if ((handle->expectPower >= 0 || handle->expectBrightness >= 0) &&
+          std::chrono::steady_clock::now() > handle->expectDeadline &&
+          !handle->readQueued) {
+        handle->readQueued = true;
+        worker->scheduler.submit(
+            bleDevice, BLE_OP_READ, [worker, handle](ble_op_done done) {
+              light_read(handle->device, handle->expectPower >= 0,
+                         handle->expectBrightness >= 0,
+                         [worker, handle, done](int power, int brightness) {
+                           LightState state;
+                           handle->readQueued = false;
+                           // A failed read publishes nothing, the next
+                           // notification or refresh reports the bulb
+                           if (power >= 0) {
+                             state.power = power;
+                           }
+                           if (brightness >= 0) {
+                             state.brightness = brightness;
+                           }
+                           light_report(handle, state);
+                           light_confirm(worker, handle, true);
+                           done();
+                         });
+            });
+      }
+      if (handle->nextAvailable) {
+        // Hand the new state to the MQTT thread for publishing
+        light_event({.type = LIGHT_EVENT_STATE,
+                     .handle = handle,
+                     .state = handle->reported});
+        handle->nextAvailable = 0;
+      }
+    }
+
+    // Verify device is connected
+    if (std::chrono::steady_clock::now() - lastCheck >
+        std::chrono::seconds(10)) {
+      lastCheck = std::chrono::steady_clock::now();
+      ble_worker_check(worker);
+    }
+
+    // Send the newest state of every bulb whose link is free, keep the
+    // links of the others up
+    bool pending = false;
+    for (auto &handle : lights) {
+      light_flush(worker, handle);
+      light_hedge(worker, handle);
+      light_supervise(worker, handle);
+      pending |= light_has(handle->desired);
+    }
+    // Hand over the lights whose link a hedge moved to another adapter
+    std::erase_if(lights, [worker](hue_device_handle *handle) {
+      return !handle->moveTo.empty() && light_idle(handle) &&
+             light_move(worker, handle);
+    });
+    worker->scheduler.dispatch();
+    pending |= worker->scheduler.queued() > 0;
+
+    worker->stats.update(count);
+    {
+      std::lock_guard<std::mutex> guard(worker->lock);
+      std::copy(std::begin(worker->scheduler.stats),
+                std::end(worker->scheduler.stats), worker->queue_wait);
+    }
+
+    // Wait for new commands
+    usleep(pending ? 10000 : 20000);
+  }
+}
+
+// Workers by adapter path and the worker serving each light, only used by the
+// MQTT thread
+std::map<std::string, ble_worker_s *> workers;
+std::map<hue_device_handle *, ble_worker_s *> light_routes;
+// Adoptions that found the command ring of their worker full
+std::vector<light_cmd_s> light_retries;
+
+// The worker of an adapter, started on first use
+static ble_worker_s *worker_get(const std::string &adapter) {
+  auto &worker = workers[adapter];
+  if (worker == nullptr) {
+    worker = new ble_worker_s;
+    worker->adapter = adapter;
+    worker->scheduler.max_in_flight = config.max_in_flight;
+    worker->thread = std::thread(ble_worker_run, worker);
+  }
+  return worker;
+}
+
+// Queue a command on the worker serving its light. A full ring drops state
+// commands, the worker coalesces them anyway so only the newest matters;
+// adoptions are kept and retried.
+static void light_send(const light_cmd_s &cmd) {
+  auto worker = light_routes[cmd.handle];
+  if (worker->commands.push(cmd)) {
+    return;
+  }
+  worker->stats.ring_full++;
+  if (cmd.type != LIGHT_CMD_STATE) {
+    light_retries.push_back(cmd);
+    return;
+  }
+  syslog(LOG_NOTICE, "command queue for %s is full, dropping command",
+         worker->adapter.c_str());
+  if (cmd.group != nullptr) {
+    group_finish(cmd.group, -1);
+  }
+}
+
+static hue_device_handle *light_find(vector<hue_device_handle *> &lights,
+                                     const std::string &mac) {
+  auto search = find_if(
+      lights.begin(), lights.end(),
+      [&mac](hue_device_handle *light) { return light->device->mac == mac; });
+  return search != lights.end() ? *search : nullptr;
+}
+
+// Hour of the week in local time, 0 is Sunday midnight
+static int hour_of_week(time_t t) {
+  struct tm local;
+  localtime_r(&t, &local);
+  return local.tm_wday * 24 + local.tm_hour;
+}
+
+// Count a command for the usage history of its light, once per hour, and
+// score the prediction of the current window
+static void light_used(hue_device_handle *handle) {
+  auto &mac = handle->device->mac;
+  time_t now = time(nullptr);
+
+  if (warmup.counted[mac] != now / 3600) {
+    warmup.counted[mac] = now / 3600;
+    light_cache.usage_add(mac, hour_of_week(now));
+  }
+  if (config.warmup_window_min <= 0) {
+    return;
+  }
+  if (warmup.warm.count(handle)) {
+    warmup.hits++;
+    warmup.used.insert(handle);
+  } else {
+    warmup.misses++;
+  }
+}
+
+// At the start of every window, connect the lights most often used in it
+// on each adapter, no more than the adapter keeps links for
+static void light_warmup(vector<hue_device_handle *> &lights) {
+  auto now = std::chrono::steady_clock::now();
+
+  if (config.warmup_window_min <= 0 || now < warmup.windowEnd) {
+    return;
+  }
+  for (auto &handle : warmup.warm) {
+    warmup.unused += !warmup.used.count(handle);
+  }
+  warmup.warm.clear();
+  warmup.used.clear();
+  warmup.windowEnd = now + std::chrono::minutes(config.warmup_window_min);
+
+  // A window may reach into the next hour
+  time_t t = time(nullptr);
+  int first = hour_of_week(t);
+  int last = hour_of_week(t + config.warmup_window_min * 60);
+  std::map<std::string, std::vector<std::pair<int, hue_device_handle *>>>
+      candidates;
+  for (auto &handle : lights) {
+    auto cached = light_cache.find(handle->device->mac);
+    if (cached == nullptr) {
+      continue;
+    }
+    int weeks = std::max(cached->usage[first], cached->usage[last]);
+    if (weeks >= config.warmup_min_weeks) {
+      candidates[light_routes[handle]->adapter].emplace_back(weeks, handle);
+    }
+  }
+  for (auto &[adapter, ranked] : candidates) {
+    sort(ranked.begin(), ranked.end(),
+         [](auto &a, auto &b) { return a.first > b.first; });
+    if (config.max_links > 0 && (int)ranked.size() > config.max_links) {
+      ranked.resize(config.max_links);
+    }
+    for (auto &[weeks, handle] : ranked) {
+      syslog(LOG_DEBUG, "warming up %s, used %d weeks at this time",
+             handle->device->mac.c_str(), weeks);
+      warmup.warm.insert(handle);
+      warmup.warmed++;
+      light_send({LIGHT_CMD_WARM, handle});
+    }
+  }
+}
+
+// Fan a group or scene command out to the worker of every member, they are
+// all written in the same pass of each worker
+static void group_command(vector<hue_device_handle *> &lights,
+                          const std::string &name,
+                          const std::vector<std::pair<std::string, std::string>>
+                              &commands,
+                          std::chrono::steady_clock::time_point deadline) {
+  std::vector<light_cmd_s> members;
+  for (auto &[mac, message] : commands) {
+    auto handle = light_find(lights, mac);
+    if (handle != nullptr) {
+      members.push_back({LIGHT_CMD_STATE, handle, light_parse(message), deadline});
+      light_used(handle);
+    }
+  }
+  if (members.empty()) {
+    return;
+  }
+  auto op = new group_op_s;
+  op->name = name;
+  op->members = op->outstanding = members.size();
+  for (auto &cmd : members) {
+    cmd.group = op;
+    light_send(cmd);
+  }
+}
+
+// Hand the retained status payload of a light to its worker
+static void light_status_recover(vector<hue_device_handle *> &lights,
+                                 struct hue_config_s &config,
+                                 const std::string &message) {
+  auto handle = light_find(lights, config.mac);
+  LightState state;
+
+  if (handle == nullptr) {
+    return;
+  }
+  try {
+    state = light_parse(message);
+  } catch (const json::exception &e) {
+    syslog(LOG_NOTICE, "ignoring status of %s: %s", config.mac.c_str(),
+           e.what());
+    return;
+  }
+  light_cache_stale.erase(config.mac);
+  light_send({LIGHT_CMD_RECOVER, handle, state});
+}
+
+// Publish the availability or state of a light from a worker event
+static void light_publish(Mqtt::Session &session, const light_event_s &event) {
+  auto mac = event.handle->device->mac;
+  auto search = find_if(
+      config.hue_lights.begin(), config.hue_lights.end(),
+      [&mac](struct hue_config_s &light) { return light.mac == mac; });
+  if (search == config.hue_lights.end()) {
+    return;
+  }
+  auto &config = *search;
+  if (event.type == LIGHT_EVENT_AVAILABILITY) {
+    session.publish(config.availability_topic,
+                    event.value ? "online" : "offline", 0, true);
+    return;
+  }
+  auto &reported = event.state;
+  auto res = json{{"state", reported.power.value_or(0) ? "ON" : "OFF"},
+                  {"brightness", reported.brightness.value_or(0)}};
+  if (reported.mireds) {
+    res["color_mode"] = "color_temp";
+    res["color_temp"] = *reported.mireds;
+  }
+  session.publish(config.status_topic, res.dump(), 0, true);
+}
+
+// Remember the link of a light that just came up: its MTU and where bluez
+// put its characteristics
+static void light_cache_link(hue_device_handle *handle, int mtu) {
+  auto &mac = handle->device->mac;
+  auto devicePath = light_routes[handle]->adapter + "/dev_" + mac;
+
+  std::replace(devicePath.begin(), devicePath.end(), ':', '_');
+  light_cache.mtu_set(mac, mtu);
+  for (auto uuid :
+       {PHILIPS_POWER_UUID, PHILIPS_LEVEL_UUID, PHILIPS_CONTROL_UUID}) {
+    light_cache.path_set(mac, uuid, bleManager.gatt_char_path(devicePath, uuid));
+  }
+}
+
+// Handle everything the workers reported since the last pass, returns the
+// number of events taken from the ring
+static unsigned long light_events_drain(Mqtt::Session &session) {
+  light_event_s event;
+  unsigned long count = 0;
+
+  while (light_events.pop(event)) {
+    count++;
+    switch (event.type) {
+    case LIGHT_EVENT_STATE:
+      light_cache.state_set(event.handle->device->mac, event.state);
+      light_cache_stale.erase(event.handle->device->mac);
+      light_publish(session, event);
+      break;
+    case LIGHT_EVENT_AVAILABILITY:
+      light_publish(session, event);
+      break;
+    case LIGHT_EVENT_GROUP_WRITE:
+      if (!event.group->written) {
+        event.group->written = true;
+        event.group->firstWrite = event.time;
+      }
+      break;
+    case LIGHT_EVENT_GROUP_DONE:
+      group_finish(event.group, event.value);
+      break;
+    case LIGHT_EVENT_MOVED:
+      light_routes[event.handle] =
+          worker_get(event.handle->device->adapterPath);
+      light_cache.adapter_set(event.handle->device->mac,
+                              light_routes[event.handle]->adapter);
+      light_send({LIGHT_CMD_ADOPT, event.handle});
+      break;
+    case LIGHT_EVENT_MTU:
+      light_cache_link(event.handle, event.value);
+      break;
+    case LIGHT_EVENT_RECOVERED: {
+      auto adapter = event.worker->adapter;
+      auto health = bleManager.adapter_stats_get()[adapter];
+      session.publish("hue2mqtt/server/" + config.client_name + "/recovery",
+                      json{{"adapter", adapter},
+                           {"recovery_ms", health.recovery_ms_last},
+                           {"links_lost", health.links_lost_last},
+                           {"links_restored", health.links_restored_last}}
+                          .dump(),
+                      0, false);
+      break;
+    }
+    case LIGHT_EVENT_BOUNCE:
+      light_send({LIGHT_CMD_STATE, event.handle, event.state, event.time,
+                  event.group});
+      break;
+    }
+  }
+  return count;
+}
+
+// Subscribe to a topic, logging a refused subscription
+static awaitable<void> mqtt_subscribe(Mqtt::Session &session,
+                                      std::string topic) {
+  int granted = co_await session.async_subscribe(topic, 0, use_awaitable);
+  if (granted < 0 || granted >= 0x80) {
+    syslog(LOG_ERR, "subscribing to %s failed: %d", topic.c_str(), granted);
+  }
+}
+
+// Take the state of every light from the retained payloads of its status
+// topic. The topics stay subscribed only as long as the broker needs to send
+// them, so the bridge never hears its own status publishes. The broker sends
+// retained payloads right after their SUBACK and answers packets in order,
+// so they are all queued by the time the last UNSUBACK arrives.
+static awaitable<void> mqtt_recover(Mqtt::Session &session) {
+  status_recovering = true;
+  status_recovered = false;
+  for (auto &light : config.hue_lights) {
+    co_await mqtt_subscribe(session, light.status_topic);
+  }
+  for (auto &light : config.hue_lights) {
+    co_await session.async_unsubscribe(light.status_topic, use_awaitable);
+  }
+  status_recovered = true;
+}
+
+// Whether bluez or the cache has seen the combined control characteristic of
+// a bulb on any adapter, the only way to set its colour temperature
+static bool light_has_control(const std::string &mac) {
+  for (auto &adapter : bleManager.adapter_list()) {
+    auto devicePath = adapter + "/dev_" + mac;
+    std::replace(devicePath.begin(), devicePath.end(), ':', '_');
+    if (!bleManager.gatt_char_path(devicePath, PHILIPS_CONTROL_UUID).empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Subscribe to the set topic of a light and add it to home assistant,
+// availability and state follow once its worker has connected it
+static awaitable<void> mqtt_announce(Mqtt::Session &session,
+                                     struct hue_config_s &config) {
+  co_await mqtt_subscribe(session, config.set_topic);
+  auto res = json{{"name", config.name},
+                  {"command_topic", config.set_topic},
+                  {"state_topic", config.status_topic},
+                  {"avty_t", config.availability_topic},
+                  {"pl_avail", "online"},
+                  {"pl_not_avail", "offline"},
+                  {"unique_id", config.mac},
+                  {"schema", "json"},
+                  {"brightness", true},
+                  {"brightness_scale", 250}};
+  // Range of the Hue white ambiance bulbs
+  if (light_has_control(config.mac)) {
+    res["supported_color_modes"] = {"color_temp"};
+    res["min_mireds"] = 153;
+    res["max_mireds"] = 454;
+  }
+  syslog(LOG_DEBUG, "publish config for %s", config.mac.c_str());
+  int reason = co_await session.async_publish(config.config_topic, res.dump(),
+                                              true, use_awaitable);
+  if (reason != 0) {
+    syslog(LOG_ERR, "config for %s was not accepted: %d", config.mac.c_str(),
+           reason);
+  }
+
+  // Last state from the previous run until the bulb has been read, flagged
+  // so it can be told apart
+  auto cached = light_cache.find(config.mac);
+  if (cached != nullptr && cached->state.power &&
+      light_cache_stale.count(config.mac)) {
+    res = json{{"state", *cached->state.power ? "ON" : "OFF"},
+               {"brightness", cached->state.brightness.value_or(0)},
+               {"cached", true}};
+    session.publish(config.status_topic, res.dump(), 0, true);
+  }
+}
+
+// Connect to the broker, then announce every light, group and scene at once
+static awaitable<void> mqtt_start(Mqtt::Session &session, std::string ip) {
+  auto executor = co_await boost::asio::this_coro::executor;
+
+  cout << "Connecting to MQTT broker..." << endl;
+  syslog(LOG_NOTICE, "Connecting to MQTT broker...");
+  int reason = co_await session.async_connect(
+      config.mqtt_host, 1883, config.client_name, config.mqtt_user,
+      config.mqtt_pass, use_awaitable);
+  if (reason != 0) {
+    syslog(LOG_ERR, "MQTT connect failed: %d", reason);
+  }
+
+  // Put hostname and ip address into MQTT
+  syslog(LOG_NOTICE, "Publishing hostname and ip address...");
+  session.publish("hue2mqtt/server/" + config.client_name + "/ip", ip, 0, true);
+
+  syslog(LOG_NOTICE, "Recovering light status...");
+  co_await mqtt_recover(session);
+
+  cout << "Updating light status..." << endl;
+  syslog(LOG_NOTICE, "Updating light status...");
+  for (auto &light : config.hue_lights) {
+    boost::asio::co_spawn(executor, mqtt_announce(session, light),
+                          boost::asio::detached);
+  }
+  for (auto &group : config.groups) {
+    boost::asio::co_spawn(executor, mqtt_subscribe(session, group.set_topic),
+                          boost::asio::detached);
+  }
+  for (auto &scene : config.scenes) {
+    boost::asio::co_spawn(executor, mqtt_subscribe(session, scene.set_topic),
+                          boost::asio::detached);
+  }
+}
+
 int main(int argc, const char *argv[]) {
   // Get commandline arguments
   std::string configPath = "";
@@ -159,207 +2046,291 @@ int main(int argc, const char *argv[]) {
 
   // Initialize bluetooth class
   cout << "Initializing bluetooth" << endl;
-  while (!bleManager.ble_power_get()) {
-    syslog(LOG_NOTICE, "waiting for bluetooth to power on...");
-    system("bluetoothctl power on");
-    sleep(1);
+  // Every BLE worker thread gets its own connection
+  dbus_threads_init_default();
+  // Enumerate adapters and map characteristic UUIDs to object paths for
+  // every known device. Adapters that show up later are reported by the
+  // watch, which stays on this thread.
+  bleManager.objects_watch("/org/bluez", true);
+  syslog(LOG_NOTICE, "Discovered %d bluez objects",
+         bleManager.gatt_discover());
+
+  // Fill in what bluez has not resolved yet from the previous run
+  if (!config.cache_file.empty()) {
+    syslog(LOG_NOTICE, "Loaded %d lights from %s",
+           light_cache.load(config.cache_file), config.cache_file.c_str());
+  }
+  for (auto &light : config.hue_lights) {
+    auto cached = light_cache.find(light.mac);
+    if (cached == nullptr) {
+      continue;
+    }
+    for (auto &[uuid, path] : cached->paths) {
+      bleManager.gatt_char_seed(path.substr(0, path.find("/service")), uuid,
+                                path);
+    }
+    light_cache_stale.insert(light.mac);
   }
 
   // Print config
   syslog(LOG_NOTICE, "Config is %s", config.toString().c_str());
   cout << config.toString() << endl;
 
-  // Initialize Hue lights
-  syslog(LOG_NOTICE, "Initializing Hue lights...");
-  vector<hue_device_handle *> lights;
-  for (auto &light : config.hue_lights) {
-    auto device = new HueDevice(light.mac);
-    lights.push_back(new hue_device_handle{device, 0, 0, 0});
+  // Initialize MQTT library, the broker is connected by mqtt_start() once
+  // the MQTT loop runs. Lights are announced with their cached state
+  // without waiting for bluetooth.
+  Mqtt::Session session;
+  session.heartbeat = config.heartbeat_interval;
+  for (auto &config : config.hue_lights) {
+    session.rate_limit(config.status_topic,
+                       config.status_interval_ms >= 0
+                           ? config.status_interval_ms
+                           : ::config.status_interval_ms);
   }
+  auto work = boost::asio::make_work_guard(session.io_context);
+  boost::asio::co_spawn(session.io_context, mqtt_start(session, ip),
+                        boost::asio::detached);
 
-  // Initialize MQTT library
-  Mqtt::Session session;
-  cout << "Connecting to MQTT broker..." << endl;
-  syslog(LOG_NOTICE, "Connecting to MQTT broker...");
-  session.init(config.mqtt_host, 1883, config.client_name, config.mqtt_user,
-               config.mqtt_pass);
+  while (!bleManager.ble_power_check()) {
+    syslog(LOG_NOTICE, "waiting for bluetooth to power on...");
+    for (int i = 0; i < 100; i++) {
+      session.process();
+      session.io_context.poll();
+      usleep(10000);
+    }
+    bleManager.process();
+    // bluez may have been started after us, before the watch could match
+    if (bleManager.adapter_list().empty()) {
+      bleManager.gatt_discover();
+    }
+  }
 
-  // Put hostname and ip address into MQTT
-  syslog(LOG_NOTICE, "Publishing hostname and ip address...");
-  session.publish("hue2mqtt/server/" + config.client_name + "/ip", ip, 0, true);
+  bleManager.max_links = config.max_links;
 
-  // Update the current state of each light for home assistant (initialization)
-  cout << "Updating light status..." << endl;
-  syslog(LOG_NOTICE, "Updating light status...");
-  for (auto &config : config.hue_lights) {
-    auto search = find_if(lights.begin(), lights.end(),
-                          [&config](hue_device_handle *light) {
-                            return light->device->mac == config.mac;
-                          });
-    if (search == lights.end()) {
-      continue;
+  // Initialize Hue lights, each stays on the adapter that served it last
+  // time unless it is pinned to another one
+  syslog(LOG_NOTICE, "Initializing Hue lights...");
+  vector<hue_device_handle *> lights;
+  for (auto &light : config.hue_lights) {
+    auto cached = light_cache.find(light.mac);
+    auto policy = config.adapter_policy;
+    auto preferred = light.adapter;
+    if (cached != nullptr && !cached->adapter.empty() &&
+        (policy != "static" || preferred.empty())) {
+      policy = "static";
+      preferred = cached->adapter.substr(cached->adapter.rfind('/') + 1);
     }
-    auto handle = *search;
-    auto bleDevice = (*search)->device;
-    // Wait for device to connect
-    while (!bleDevice->device_connected_get()) {
-      syslog(LOG_NOTICE, "waiting for %s to connect...",
-             bleDevice->devicePath.c_str());
-      bleDevice->device_connected_set(1);
-      sleep(1);
+    auto device = new HueDevice(
+        light.mac, bleManager.adapter_assign(light.mac, policy, preferred));
+    device->priority = light.priority;
+    if (cached != nullptr && cached->mtu > 0) {
+      device->light_power_buf.resize(cached->mtu);
+      device->light_brightness_buf.resize(cached->mtu);
     }
-    // Subscribe to the set topic
-    session.subscribe(config.set_topic, 0, 1);
-    // Publish the availability of the light
-    syslog(LOG_DEBUG, "publish availability for %s",
-           bleDevice->devicePath.c_str());
-    session.publish(config.availability_topic,
-                    bleDevice->device_connected_get() ? "online" : "offline", 0,
-                    true);
-    // Publish the current state of the light
-    handle->nextAvailable = 1;
-    handle->nextPower = bleDevice->light_power_get();
-    handle->nextBrightness = bleDevice->light_brightness_get();
-    // Add light to homeassistant topics
-    auto res = json{{"name", config.name},
-                    {"command_topic", config.set_topic},
-                    {"state_topic", config.status_topic},
-                    {"avty_t", config.availability_topic},
-                    {"pl_avail", "online"},
-                    {"pl_not_avail", "offline"},
-                    {"unique_id", config.mac},
-                    {"schema", "json"},
-                    {"brightness", true},
-                    {"brightness_scale", 250}};
-    syslog(LOG_DEBUG, "publish status for %s", bleDevice->devicePath.c_str());
-    session.publish(config.config_topic, res.dump(), 0, true);
-  }
-
-  // Main loop
+    light_cache.adapter_set(light.mac, device->adapterPath);
+    lights.push_back(new hue_device_handle{.device = device});
+  }
+
+  // From here on only the workers talk to bluez, this thread just follows
+  // adapters coming and going
+  for (auto &handle : lights) {
+    auto cached = light_cache.find(handle->device->mac);
+    light_routes[handle] = worker_get(handle->device->adapterPath);
+    light_send({LIGHT_CMD_START, handle,
+                cached != nullptr ? cached->state : LightState{}});
+  }
+
+  // MQTT loop
   while (true) {
-    // Receive BLE notifications
-    for (auto &handle : lights) {
-      auto &bleDevice = handle->device;
-      const int power_fd = bleDevice->light_power_notify_get();
-      const int brightness_fd = bleDevice->light_brightness_notify_get();
-      if (power_fd > 0) {
-        static char power_buf[1];
-        const int s = read(power_fd, power_buf, 1);
-        if (s > 0) {
-          handle->nextPower = power_buf[0] & 0xFF;
-          handle->nextAvailable = 1;
+    // Handle MQTT protocol and resume the flows whose packets were answered
+    session.process();
+    session.io_context.poll();
+
+    // Route every queued MQTT message to the workers of its bulbs
+    unsigned long count = 0;
+    while (!session.pub_incoming_queue.empty()) {
+      auto msg = session.pub_incoming_queue.front();
+      session.pub_incoming_queue.pop();
+      syslog(LOG_DEBUG, "Received message from the Broker...");
+      syslog(LOG_DEBUG, "\t topic: %s", msg.topic.c_str());
+      syslog(LOG_DEBUG, "\t payload: %s", msg.message.c_str());
+
+      for (auto &config : config.hue_lights) {
+        if (msg.topic == config.status_topic && msg.retain &&
+            status_recovering) {
+          light_status_recover(lights, config, msg.message);
+          continue;
+        }
+        if (msg.topic != config.set_topic) {
+          continue;
+        }
+        // Find the light (bluetooth connection) that the message is for
+        auto handle = light_find(lights, config.mac);
+        if (handle != nullptr) {
+          light_send({LIGHT_CMD_STATE, handle, light_parse(msg.message),
+                      command_deadline(msg)});
+          light_used(handle);
         }
       }
-      if (brightness_fd > 0) {
-        static char brightness_buf[1];
-        const int s = read(brightness_fd, brightness_buf, 1);
-        if (s > 0) {
-          handle->nextBrightness = brightness_buf[0] & 0xFF;
-          handle->nextAvailable = 1;
+      for (auto &group : config.groups) {
+        if (msg.topic == group.set_topic) {
+          std::vector<std::pair<std::string, std::string>> commands;
+          for (auto &mac : group.members) {
+            commands.emplace_back(mac, msg.message);
+          }
+          group_command(lights, group.name, commands, command_deadline(msg));
         }
       }
-      if (handle->nextAvailable) {
-        // publish the new state
-        auto res = json{{"state", handle->nextPower ? "ON" : "OFF"},
-                        {"brightness", handle->nextBrightness}};
-        syslog(LOG_DEBUG, "publish status for %s",
-               bleDevice->devicePath.c_str());
-        auto search =
-            find_if(config.hue_lights.begin(), config.hue_lights.end(),
-                    [&bleDevice](struct hue_config_s &light) {
-                      return light.mac == bleDevice->mac;
-                    });
-        if (search != config.hue_lights.end()) {
-          auto &config = *search;
-          session.publish(config.status_topic, res.dump(), 0, true);
+      for (auto &scene : config.scenes) {
+        if (msg.topic == scene.set_topic) {
+          std::vector<std::pair<std::string, std::string>> commands;
+          for (auto &[mac, state] : scene.states) {
+            commands.emplace_back(mac, state.dump());
+          }
+          group_command(lights, scene.name, commands, command_deadline(msg));
         }
-        handle->nextAvailable = 0;
       }
     }
 
-    // Verify device is connected
-    static int timeout0 = 0;
-    if (timeout0++ > 100) {
-      timeout0 = 0;
-      for (auto &handle : lights) {
-        auto &bleDevice = handle->device;
-        if (!bleDevice->device_connected_get()) {
-          syslog(LOG_NOTICE, "%s is disconnected, reconnecting...",
-                 bleDevice->devicePath.c_str());
-          bleDevice->light_power_fd = 0;
-          bleDevice->light_brightness_fd = 0;
-          bleDevice->device_connected_set(1);
+    // Every retained status payload has been routed
+    if (status_recovering && status_recovered) {
+      status_recovering = false;
+    }
+
+    // Every adapter gets a worker, also those plugged in after startup, so
+    // its power is checked and lights leaving a failed adapter can move to it
+    static auto lastAdapters = std::chrono::steady_clock::time_point{};
+    if (std::chrono::steady_clock::now() - lastAdapters >
+        std::chrono::seconds(1)) {
+      lastAdapters = std::chrono::steady_clock::now();
+      bleManager.process();
+      for (auto &adapter : bleManager.adapter_list()) {
+        if (!workers.contains(adapter)) {
+          syslog(LOG_NOTICE, "starting a worker for %s", adapter.c_str());
+          worker_get(adapter);
         }
       }
     }
 
-    // Handle MQTT protocol
-    session.process();
+    // Publish what the workers reported
+    count += light_events_drain(session);
+    light_warmup(lights);
+    auto retries = std::move(light_retries);
+    light_retries.clear();
+    for (auto &cmd : retries) {
+      light_send(cmd);
+    }
 
-    // Wait for new MQTT messages
-    if (session.pub_incoming_queue.empty()) {
-      usleep(100000);
-      continue;
+    // Report how long each finished group command took
+    while (!group_reports.empty()) {
+      session.publish("hue2mqtt/server/" + config.client_name + "/groups",
+                      group_reports.front().dump(), 0, false);
+      group_reports.pop();
     }
+    mqtt_stats.update(count);
 
-    // Get next MQTT message (from currently subscribed topics)
-    auto msg = session.pub_incoming_queue.front();
-    session.pub_incoming_queue.pop();
-    syslog(LOG_DEBUG, "Received message from the Broker...");
-    syslog(LOG_DEBUG, "\t topic: %s", msg.topic.c_str());
-    syslog(LOG_DEBUG, "\t payload: %s", msg.message.c_str());
+    // Persist what changed, at most every 10 seconds
+    static auto lastCache = std::chrono::steady_clock::now();
+    if (light_cache.changed() && !config.cache_file.empty() &&
+        std::chrono::steady_clock::now() - lastCache >
+            std::chrono::seconds(10)) {
+      lastCache = std::chrono::steady_clock::now();
+      light_cache.save(config.cache_file);
+    }
 
-    // Handle requests from home assistant/node red
-    for (auto &config : config.hue_lights) {
-      if (msg.topic == config.set_topic) {
-        bool available = false;
-        int brightness = 0;
-        std::string state = "UNK";
-        // Find the light (bluetooth connection) that the message is for
-        auto search = find_if(lights.begin(), lights.end(),
-                              [&config](hue_device_handle *light) {
-                                return light->device->mac == config.mac;
-                              });
-        if (search == lights.end()) {
-          continue;
-        }
-        auto handler = *search;
-        auto bleDevice = (*search)->device;
-        if ((available = bleDevice->device_connected_get())) {
-          // Parse the message
-          if (msg.message.starts_with("{")) {
-            // Handle JSON requests
-            auto req = json::parse(msg.message);
-            if (req.contains("state")) {
-              req.at("state").get_to(state);
-            }
-            if (req.contains("brightness")) {
-              req.at("brightness").get_to(brightness);
-            }
-          } else if (msg.message == "OFF" || msg.message == "ON") {
-            // Handle simple ON/OFF requests
-            state = msg.message;
-            brightness = bleDevice->light_brightness_get();
-          }
-          // Set the light to the requested state
-          if (state == "ON" || state == "OFF") {
-            bleDevice->light_power_set(state == "ON");
-            if (bleDevice->light_power_get() == (state == "ON")) {
-              handler->nextPower = state == "ON";
-              handler->nextAvailable = 1;
-            }
-          }
-          // Set the brightness to the requested level
-          if (brightness > 0) {
-            bleDevice->light_brightness_set(brightness);
-            if (bleDevice->light_brightness_get() == brightness) {
-              handler->nextBrightness = brightness;
-              handler->nextAvailable = 1;
-            }
-          }
+    // Publish bridge statistics
+    static auto lastStats = std::chrono::steady_clock::now();
+    if (std::chrono::steady_clock::now() - lastStats >
+        std::chrono::seconds(config.stats_interval)) {
+      lastStats = std::chrono::steady_clock::now();
+      auto pool = bleManager.pool_get();
+      const unsigned int connects = pool.misses ? pool.misses : 1;
+      auto stats = json{
+          {"links", pool.links},
+          {"pool_hits", pool.hits},
+          {"pool_misses", pool.misses},
+          {"pool_evictions", pool.evictions},
+          {"pool_hit_rate",
+           pool.hits + pool.misses
+               ? (double)pool.hits / (pool.hits + pool.misses)
+               : 1.0},
+          {"cold_connect_ms_avg", pool.connect_ms_total / connects},
+          {"cold_connect_ms_max", pool.connect_ms_max},
+          {"publishes_suppressed", session.suppressed}};
+      stats["signals"] = {{"received", bleManager.signals_received.load()},
+                          {"handled", bleManager.signals_handled.load()}};
+      stats["commands"] = {{"received", command_stats.received.load()},
+                           {"superseded", command_stats.superseded.load()},
+                           {"expired", command_stats.expired.load()},
+                           {"suppressed", command_stats.suppressed.load()},
+                           {"retried", command_stats.retried.load()}};
+      const unsigned long hits = link_stats.command_hits;
+      const unsigned long misses = link_stats.command_misses;
+      stats["link_supervisor"] = {
+          {"command_hits", hits},
+          {"command_misses", misses},
+          {"command_hit_rate",
+           hits + misses ? (double)hits / (hits + misses) : 1.0},
+          {"drops", link_stats.drops.load()},
+          {"keepalives", link_stats.keepalives.load()},
+          {"cycled", link_stats.cycled.load()}};
+      const unsigned long fired = hedge_stats.fired;
+      stats["hedging"] = {{"enabled", config.hedge_writes},
+                          {"fired", fired},
+                          {"won", hedge_stats.won.load()},
+                          {"win_rate", fired ? (double)hedge_stats.won / fired
+                                             : 0.0},
+                          {"moved", hedge_stats.moved.load()}};
+      stats["warmup"] = {
+          {"warmed", warmup.warmed},
+          {"hits", warmup.hits},
+          {"misses", warmup.misses},
+          {"unused", warmup.unused},
+          {"hit_rate", warmup.hits + warmup.misses
+                           ? (double)warmup.hits /
+                                 (warmup.hits + warmup.misses)
+                           : 1.0}};
+      for (auto &[adapter, health] : bleManager.adapter_stats_get()) {
+        stats["adapters"][adapter] = {
+            {"calls", health.calls},
+            {"errors", health.errors},
+            {"timeouts", health.timeouts},
+            {"latency_ms_avg",
+             health.calls ? health.latency_ms_total / health.calls : 0},
+            {"latency_ms_max", health.latency_ms_max},
+            {"recoveries", health.recoveries},
+            {"recovery_ms_last", health.recovery_ms_last}};
+      }
+      BleScheduler::class_stats queue_wait[BLE_OP_CLASSES];
+      stats["threads"]["mqtt"] = mqtt_stats.to_json();
+      for (auto &[adapter, worker] : workers) {
+        stats["threads"][adapter] = worker->stats.to_json();
+        stats["hedging"]["write_p95_ms"][adapter] = worker->writeP95.load();
+        stats["hedging"]["confirm_p95_ms"][adapter] =
+            worker->confirmP95.load();
+        std::lock_guard<std::mutex> guard(worker->lock);
+        for (int i = 0; i < BLE_OP_CLASSES; i++) {
+          auto &q = worker->queue_wait[i];
+          queue_wait[i].dispatched += q.dispatched;
+          queue_wait[i].wait_ms_total += q.wait_ms_total;
+          queue_wait[i].wait_ms_max =
+              std::max(queue_wait[i].wait_ms_max, q.wait_ms_max);
         }
       }
+      const char *classes[] = {"command", "read", "connect"};
+      for (int i = 0; i < BLE_OP_CLASSES; i++) {
+        auto &q = queue_wait[i];
+        stats["queue_wait"][classes[i]] = {
+            {"dispatched", q.dispatched},
+            {"wait_ms_avg", q.dispatched ? q.wait_ms_total / q.dispatched : 0},
+            {"wait_ms_max", q.wait_ms_max}};
+      }
+      session.publish("hue2mqtt/server/" + config.client_name + "/stats",
+                      stats.dump(), 0, false);
     }
+
+    // Wait for new MQTT messages and worker events
+    usleep(10000);
   }
 
   closelog();
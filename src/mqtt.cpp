@@ -2,8 +2,8 @@
 #include <sys/syslog.h>
 
 namespace Mqtt {
-const bool controlPacketRequiresIdentifier(uint8_t control_packet_type,
-                                           uint8_t qos) {
+bool controlPacketRequiresIdentifier(uint8_t control_packet_type,
+                                     uint8_t qos) {
   return (control_packet_type == ControlPacketType::PUBLISH && qos > 0) ||
          control_packet_type == ControlPacketType::SUBSCRIBE ||
          control_packet_type == ControlPacketType::UNSUBSCRIBE ||
@@ -44,7 +44,7 @@ int encodeInt(uint8_t *buffer, int n) {
 int encodeString(uint8_t *buffer, const string str) {
   buffer[0] = str.length() >> 8;
   buffer[1] = str.length() & 0xFF;
-  for (int i = 0; i < str.length(); i++) {
+  for (size_t i = 0; i < str.length(); i++) {
     buffer[i + 2] = str[i];
   }
   return str.length() + 2;
@@ -67,23 +67,44 @@ Publish publishFromBytes(uint8_t header, int32_t len, uint8_t *buffer) {
   }
 
   // Get Properties if there are any
-  if (buffer_iter[0] == 0) {
-    buffer_iter++;
-  } else {
-    auto [properties_len, properties] = decodeInt(buffer_iter);
-    buffer_iter += properties_len;
-
-    cout << "Unhandled Properties Length: " << properties << " ? "
-         << properties_len << endl;
+  uint32_t message_expiry = 0;
+  auto [properties_len, properties] = decodeInt(buffer_iter);
+  buffer_iter += properties_len;
+  uint8_t *properties_iter = buffer_iter;
+  while (properties_iter < buffer_iter + properties) {
+    const uint8_t id = *properties_iter++;
+    if (id == PublishProperties::MESSAGE_EXPIRY_INTERVAL) {
+      message_expiry = properties_iter[0] << 24 | properties_iter[1] << 16 |
+                       properties_iter[2] << 8 | properties_iter[3];
+      properties_iter += 4;
+    } else if (id == PublishProperties::PAYLOAD_FORMAT_INDICATOR) {
+      properties_iter += 1;
+    } else if (id == PublishProperties::TOPIC_ALIAS) {
+      properties_iter += 2;
+    } else if (id == PublishProperties::CONTENT_TYPE ||
+               id == PublishProperties::RESPONSE_TOPIC ||
+               id == PublishProperties::CORRELATION_DATA) {
+      properties_iter += 2 + (properties_iter[0] << 8 | properties_iter[1]);
+    } else if (id == PublishProperties::USER_PROPERTY) {
+      for (int i = 0; i < 2; i++) {
+        properties_iter += 2 + (properties_iter[0] << 8 | properties_iter[1]);
+      }
+    } else if (id == PublishProperties::SUBSCRIPTION_IDENTIFIER) {
+      properties_iter += get<0>(decodeInt(properties_iter));
+    } else {
+      cout << "Unhandled Property: " << (int)id << endl;
+      break;
+    }
   }
+  buffer_iter += properties;
 
   const string message =
       string((char *)buffer_iter, len - (buffer_iter - buffer));
 
-  return {qos, retain, packet_identifier, topic, message};
+  return {qos, retain, packet_identifier, topic, message, message_expiry};
 }
 
-ConnAck connAckFromBytes(uint8_t header, int32_t len, uint8_t *buffer) {
+ConnAck connAckFromBytes(uint8_t, int32_t, uint8_t *) {
   //   uint8_t ack_flags = buffer[0];
   //   uint8_t conn_reason = buffer[1];
   //   auto [property_len, property] = decodeInt(buffer + 2);
@@ -146,7 +167,7 @@ void connect(boost::asio::ip::tcp::socket &socket, string client_id,
 
   if (debug) {
     cout << "Sending connect packet: ";
-    for (int i = 0; i < buffer_size; i++) {
+    for (size_t i = 0; i < buffer_size; i++) {
       cout << " " << (unsigned int)control_packet[i];
     }
     cout << endl;
@@ -197,7 +218,7 @@ void publish(boost::asio::ip::tcp::socket &socket, string topic, string message,
 
   if (debug) {
     cout << "Sending publish packet: ";
-    for (int i = 0; i < buffer_size; i++) {
+    for (size_t i = 0; i < buffer_size; i++) {
       cout << " " << (unsigned int)control_packet[i];
     }
     cout << endl;
@@ -241,7 +262,49 @@ void subscribe(boost::asio::ip::tcp::socket &socket, string topic, uint8_t qos,
 
   if (debug) {
     cout << "Sending subscribe packet: ";
-    for (int i = 0; i < buffer_size; i++) {
+    for (size_t i = 0; i < buffer_size; i++) {
+      cout << " " << (unsigned int)control_packet[i];
+    }
+    cout << endl;
+  }
+
+  socket.write_some(boost::asio::buffer(control_packet, buffer_size));
+  delete[] control_packet;
+}
+
+void unsubscribe(boost::asio::ip::tcp::socket &socket, string topic,
+                 uint16_t packet_identifier) {
+  uint8_t fixed_header = ControlPacketType::UNSUBSCRIBE << 4 |
+                         ControlPacketFlags::UNSUBSCRIBE;
+
+  size_t packet_len = 2 + 1 + (topic.length() + 2);
+  uint8_t encoded_control_packet_length[4];
+  uint8_t bytes_for_packet_length =
+      encodeInt(encoded_control_packet_length, packet_len);
+  size_t buffer_size = 1 + bytes_for_packet_length + packet_len;
+  uint8_t *control_packet = new uint8_t[buffer_size];
+  uint8_t *control_packet_iter = control_packet;
+
+  // Add fixed header
+  control_packet_iter[0] = fixed_header;
+  control_packet_iter++;
+  // Add variable header
+  //  Add remaining length
+  control_packet_iter += encodeInt(control_packet_iter, packet_len);
+  //  Add packet identifier
+  control_packet_iter[0] = packet_identifier >> 8;
+  control_packet_iter[1] = packet_identifier & 0xFF;
+  control_packet_iter += 2;
+  //  Add properties
+  control_packet_iter[0] = 0;
+  control_packet_iter++;
+  // Add payload
+  //  Add topic
+  control_packet_iter += encodeString(control_packet_iter, topic);
+
+  if (debug) {
+    cout << "Sending unsubscribe packet: ";
+    for (size_t i = 0; i < buffer_size; i++) {
       cout << " " << (unsigned int)control_packet[i];
     }
     cout << endl;
@@ -291,10 +354,14 @@ void Session::process() {
   }
 
   // publish queued messages
+  flush();
+  republish();
   if (isConnected && !pub_outgoing_queue.empty()) {
     Publish pub = pub_outgoing_queue.front();
+    syslog(LOG_DEBUG, "publish %s", pub.topic.c_str());
     try {
-      Mqtt::publish(socket, pub.topic, pub.message, pub.qos, pub.retain);
+      Mqtt::publish(socket, pub.topic, pub.message, pub.qos, pub.retain,
+                    pub.packet_identifier);
       pub_outgoing_queue.pop();
     } catch (const std::exception &e) {
       syslog(LOG_ERR, "Error sending publish packet: %s", e.what());
@@ -364,6 +431,11 @@ void Session::handleSocket() {
              connack.shared_subscription_available);
       isConnected = true;
       timeout0 = 0;
+      auto waiting = std::move(connacks);
+      connacks.clear();
+      for (auto &connected : waiting) {
+        connected(len > 1 ? recv[1] : 0);
+      }
     } else if (command == ControlPacketType::PUBLISH) {
       Publish publish = publishFromBytes(header[0], len, recv);
       if (debug) {
@@ -377,14 +449,26 @@ void Session::handleSocket() {
       pub_incoming_queue.push(publish);
     } else if (command == ControlPacketType::PUBACK) {
       syslog(LOG_NOTICE, "Received PUBACK");
+      if (len >= 2) {
+        ack(recv[0] << 8 | recv[1], len > 2 ? recv[2] : 0);
+      }
     } else if (command == ControlPacketType::PUBREC) {
       syslog(LOG_NOTICE, "Received PUBREC");
     } else if (command == ControlPacketType::PUBREL) {
       syslog(LOG_NOTICE, "Received PUBREL");
     } else if (command == ControlPacketType::PUBCOMP) {
       syslog(LOG_NOTICE, "Received PUBCOMP");
-    } else if (command == ControlPacketType::SUBACK) {
-      syslog(LOG_NOTICE, "Received SUBACK");
+    } else if (command == ControlPacketType::SUBACK ||
+               command == ControlPacketType::UNSUBACK) {
+      syslog(LOG_NOTICE, command == ControlPacketType::SUBACK
+                             ? "Received SUBACK"
+                             : "Received UNSUBACK");
+      if (len >= 3) {
+        // Reason code of the first topic follows the properties
+        auto [properties_len, properties] = decodeInt(recv + 2);
+        const int reason_at = 2 + properties_len + properties;
+        ack(recv[0] << 8 | recv[1], reason_at < len ? recv[reason_at] : 0x80);
+      }
     } else if (command == ControlPacketType::PINGREQ) {
       syslog(LOG_NOTICE, "Received PINGREQ");
     } else if (command == ControlPacketType::PINGRESP) {
@@ -436,9 +520,38 @@ void Session::init(string addr, int port, string client_id, string username,
     sleep(1);
   }
 }
+// Like init(), but only sends CONNECT. `connected` gets the CONNACK reason
+// code once process() receives it, or -1 if the broker is unreachable.
+void Session::init(string addr, int port, string client_id, string username,
+                   string password, function<void(int)> connected) {
+  this->client_id = client_id;
+  this->username = username;
+  this->password = password;
+  this->addr = addr;
+  this->port = port;
+
+  try {
+    socket.connect(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string(addr), port));
+    Mqtt::connect(socket, client_id, username, password);
+    connacks.push_back(connected);
+  } catch (const std::exception &e) {
+    syslog(LOG_ERR, "Error connecting to MQTT server: %s", e.what());
+    isDisconnected = true;
+    connected(-1);
+  }
+}
+
 void Session::connect() {
   int timeout = 0;
 
+  // Acknowledgements of the old connection will never arrive
+  auto waiting = std::move(acks);
+  acks.clear();
+  for (auto &[packet_identifier, acked] : waiting) {
+    acked(-1);
+  }
+
   if (isDisconnected && socket.is_open()) {
     syslog(LOG_NOTICE, "Disconnecting from MQTT server...");
     socket.close();
@@ -481,7 +594,67 @@ void Session::connect() {
 }
 
 void Session::publish(string topic, string message, uint8_t qos, bool retain) {
-  pub_outgoing_queue.push({qos, retain, 1, topic, message});
+  auto limit = rate_limits.find(topic);
+  if (limit != rate_limits.end()) {
+    auto now = chrono::steady_clock::now();
+    auto &last = last_sent[topic];
+    if (now - last < limit->second) {
+      held[topic] = {qos, retain, 1, topic, message};
+      return;
+    }
+    held.erase(topic);
+    last = now;
+  }
+  send({qos, retain, 1, topic, message});
+}
+
+void Session::send(const Publish &pub) {
+  if (pub.retain) {
+    auto search = retained.find(pub.topic);
+    if (search != retained.end() && search->second.message == pub.message) {
+      suppressed++;
+      return;
+    }
+    retained[pub.topic] = {pub.message, pub.qos, chrono::steady_clock::now()};
+  }
+  pub_outgoing_queue.push(pub);
+}
+
+// Send held payloads of rate limited topics whose interval has ended
+void Session::flush() {
+  auto now = chrono::steady_clock::now();
+  for (auto it = held.begin(); it != held.end();) {
+    auto &last = last_sent[it->first];
+    if (now - last >= rate_limits[it->first]) {
+      last = now;
+      send(it->second);
+      it = held.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+void Session::rate_limit(string topic, int interval_ms) {
+  if (interval_ms > 0) {
+    rate_limits[topic] = chrono::milliseconds(interval_ms);
+  } else {
+    rate_limits.erase(topic);
+  }
+}
+
+// Publish retained payloads again once they are older than the heartbeat
+void Session::republish() {
+  if (heartbeat <= 0) {
+    return;
+  }
+  auto now = chrono::steady_clock::now();
+  for (auto &[topic, last] : retained) {
+    if (now - last.sent > chrono::seconds(heartbeat)) {
+      last.sent = now;
+      pub_outgoing_queue.push({last.qos, true, 1, topic, last.message});
+    }
+  }
 }
 
 void Session::subscribe(string topic, uint8_t qos, uint16_t packet_identifier) {
@@ -498,4 +671,69 @@ void Session::subscribe(string topic, uint8_t qos, uint16_t packet_identifier) {
     isDisconnected = true;
   }
 }
+// Identifiers of packets waiting for an acknowledgement, 1 is left to the
+// packets nobody waits for
+uint16_t Session::packet_identifier_next() {
+  do {
+    last_packet_identifier++;
+  } while (last_packet_identifier < 2 || acks.count(last_packet_identifier));
+  return last_packet_identifier;
+}
+
+void Session::ack(uint16_t packet_identifier, int reason) {
+  auto search = acks.find(packet_identifier);
+  if (search == acks.end()) {
+    return;
+  }
+  auto acked = std::move(search->second);
+  acks.erase(search);
+  acked(reason);
+}
+
+// Publish with QoS 1, `acked` gets the PUBACK reason code. The payload skips
+// rate limiting and duplicate suppression so that every call is answered.
+void Session::publish(string topic, string message, bool retain,
+                      function<void(int)> acked) {
+  Publish pub = {1, retain, packet_identifier_next(), topic, message};
+  if (retain) {
+    retained[topic] = {message, 1, chrono::steady_clock::now()};
+  }
+  acks[pub.packet_identifier] = acked;
+  pub_outgoing_queue.push(pub);
+}
+
+// Subscribe and wait for the SUBACK, `acked` gets the granted QoS or a
+// reason code >= 0x80
+void Session::subscribe(string topic, uint8_t qos, function<void(int)> acked) {
+  auto search =
+      find_if(subscriptions.begin(), subscriptions.end(),
+              [&topic](Subscribe &sub) { return sub.topic == topic; });
+  if (search != subscriptions.end()) {
+    acked(search->qos);
+    return;
+  }
+  const uint16_t packet_identifier = packet_identifier_next();
+  acks[packet_identifier] = acked;
+  subscribe(topic, qos, packet_identifier);
+  if (isDisconnected) {
+    acks.erase(packet_identifier);
+    acked(-1);
+  }
+}
+
+// Unsubscribe and wait for the UNSUBACK, `acked` gets its reason code. The
+// topic is no longer subscribed again after a reconnect.
+void Session::unsubscribe(string topic, function<void(int)> acked) {
+  const uint16_t packet_identifier = packet_identifier_next();
+  erase_if(subscriptions,
+           [&topic](Subscribe &sub) { return sub.topic == topic; });
+  acks[packet_identifier] = acked;
+  try {
+    Mqtt::unsubscribe(socket, topic, packet_identifier);
+  } catch (const std::exception &e) {
+    isDisconnected = true;
+    acks.erase(packet_identifier);
+    acked(-1);
+  }
+}
 } // namespace Mqtt
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <chrono>
 #include <dbus/dbus.h>
 #include <fstream>
 #include <ifaddrs.h>
@@ -13,6 +14,7 @@
 #include <BleDevice.hpp>
 #include <BleManager.hpp>
 #include <HueDevice.hpp>
+#include <LinkMonitor.hpp>
 
 using namespace std;
 using nlohmann::json;
@@ -20,12 +22,144 @@ using nlohmann::json;
 // Reference:
 // https://github.com/wware/stuff/blob/master/dbus-example/dbus-example.c
 
-int main()
+// Time `count` brightness writes and print throughput and p99 latency
+static void bench_writes(HueDevice &device, bool fast, int count)
 {
+	vector<double> latency;
+	string path = device.light_brightness_path();
+
+	if (count <= 0)
+		return;
+	device.gatt_write_fast = fast;
+	device.gatt_release_fds();
+	latency.reserve(count);
+
+	// Each write is timed until its completion: the WriteValue reply, or the
+	// socket write for AcquireWrite, which the bulb does not acknowledge
+	auto start = chrono::steady_clock::now();
+	for (int i = 0; i < count; i++) {
+		bool done = false;
+		auto t0 = chrono::steady_clock::now();
+		device.gatt_write_char_byte(path, 1 + (i % 0xFE), [&done](int) { done = true; });
+		while (!done)
+			bleManager.process();
+		auto t1 = chrono::steady_clock::now();
+		latency.push_back(chrono::duration<double, micro>(t1 - t0).count());
+	}
+	double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	sort(latency.begin(), latency.end());
+	cout << (fast ? "AcquireWrite" : "WriteValue  ") << " writes/s: " << count / total
+	     << " p99: " << latency[(latency.size() * 99) / 100] << "us" << endl;
+}
+
+// Time building `count` WriteValue calls from scratch and from a template,
+// no bus or bulb needed. Values cycle through 254 brightness levels, so the
+// templates are warm after the first pass. The two are interleaved over
+// several rounds and the median rate of each is printed, single runs vary by
+// more than the gap.
+static void bench_marshal(int count)
+{
+	HueDevice device("00:00:00:00:00:00");
+	string path = device.devicePath + "/service002c/char0032";
+	vector<double> rates[2];
+
+	if (count <= 0)
+		return;
+	for (int round = 0; round < 7; round++) {
+		for (int fresh = 1; fresh >= 0; fresh--) {
+			auto start = chrono::steady_clock::now();
+			for (int i = 0; i < count; i++) {
+				uint8_t value = 1 + (i % 0xFE);
+				const uint8_t *bytes = &value;
+				DBusMessage *msg;
+
+				if (fresh) {
+					DBusMessageIter iter0, iter1;
+
+					msg = dbus_message_new_method_call("org.bluez", path.c_str(),
+									   "org.bluez.GattCharacteristic1", "WriteValue");
+					dbus_message_iter_init_append(msg, &iter0);
+					dbus_message_iter_open_container(&iter0, DBUS_TYPE_ARRAY, "y", &iter1);
+					dbus_message_iter_append_fixed_array(&iter1, DBUS_TYPE_BYTE, &bytes, 1);
+					dbus_message_iter_close_container(&iter0, &iter1);
+					dbus_message_iter_open_container(&iter0, DBUS_TYPE_ARRAY, "{sv}", &iter1);
+					dbus_message_iter_close_container(&iter0, &iter1);
+				} else {
+					msg = device.gatt_write_message(path, bytes, 1);
+				}
+				dbus_message_unref(msg);
+			}
+			double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			rates[fresh].push_back(count / total);
+		}
+	}
+	for (int fresh = 1; fresh >= 0; fresh--) {
+		auto &r = rates[fresh];
+
+		sort(r.begin(), r.end());
+		cout << (fresh ? "new_method_call" : "template copy  ") << " messages/s: " << r[r.size() / 2] << endl;
+	}
+}
+
+// Run one early reconnect through the link bookkeeping the way the worker
+// does: the disconnect of the old link is reported after the new link is
+// up. It must not count as a drop, which would release the new link and
+// queue another reconnect. Returns the number of failed checks.
+static int test_link_cycle()
+{
+	LinkMonitor link;
+	auto t = chrono::steady_clock::now();
+	int failed = 0;
+	auto check = [&failed](bool ok, const char *what) {
+		cout << (ok ? "ok   " : "FAIL ") << what << endl;
+		failed += !ok;
+	};
+
+	link.up(t);
+	link.cycle(t + 50s);
+	link.up(t + 51s);
+	check(!link.dropped(t + 51500ms, true, 20000), "the disconnect of a cycle queues no reconnect");
+	check(link.drops == 0 && link.dropAge.empty() && link.dropIdle.empty(), "the disconnect of a cycle is no drop");
+	check(!link.cycling(t + 52s), "the cycle ends with its disconnect");
+	check(link.dropped(t + 60s, true, 20000), "a later disconnect queues a reconnect");
+	check(link.drops == 1 && link.dropAge.size() == 1 && link.dropAge[0] == 9, "a later disconnect is a drop");
+	check(!link.dropped(t + 70s, false, 20000) && link.drops == 1, "a released link is no drop");
+	return failed;
+}
+
+int main(int argc, const char *argv[])
+{
+	// testing -l: link supervision checks, no bus or bulb needed
+	if (argc > 1 && strcmp(argv[1], "-l") == 0)
+		return test_link_cycle() == 0 ? 0 : 1;
+
+	// testing -m [count]: compare WriteValue marshalling
+	if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+		bench_marshal(argc > 2 ? atoi(argv[2]) : 100000);
+		return 0;
+	}
+
+	// testing -w <mac> [count]: compare GATT write paths against a bulb
+	if (argc > 2 && strcmp(argv[1], "-w") == 0) {
+		HueDevice device(argv[2]);
+		int count = argc > 3 ? atoi(argv[3]) : 1000;
+
+		bleManager.gatt_discover();
+		while (!device.device_connected_get()) {
+			device.device_connected_set(1);
+			sleep(1);
+		}
+		bench_writes(device, false, count);
+		bench_writes(device, true, count);
+		return 0;
+	}
+
 	for (int i = 0; i < 128; i++) {
-		bleManager.ble_power_get();
+		bleManager.ble_power_get(BLUEZ_DEFAULT_ADAPTER);
 	}
 	cout << "DONE" << endl;
 
 	return 0;
-}
\ No newline at end of file
+}